@@ -0,0 +1,163 @@
+#!/bin/sh
+#
+# ICMPmonitor benchmark harness
+#
+# Monitors N synthetic hosts, answered by `reflector` through a TUN device,
+# and reports probes per second, CPU time per probe, memory per host and how
+# long outages take to detect. Linux only, and must be run as root.
+#
+# See LICENSE file for copyright and license details.
+
+HOSTS=10000         # Synthetic hosts, at most 65000.
+INTERVAL=1          # Ping interval of each host.
+MAX_DELAY=3         # Seconds without a reply before a host is down.
+RTT=1               # Milliseconds the reflector delays each reply.
+LOSS=0              # Percentage of pings the reflector drops.
+THREADS=1           # Passed to icmpmonitor -s.
+DURATION=10         # Seconds over which probe rate and CPU time are measured.
+WATCHED=100         # Hosts blackholed to measure detection latency, at most 254.
+
+usage() {
+    echo "Usage: $0 [-n <hosts>] [-i <interval>] [-d <max_delay>] [-r <rtt ms>] [-l <loss %>] [-s <threads>] [-t <seconds>] [-w <watched>]"
+    exit 1
+}
+
+while getopts "n:i:d:r:l:s:t:w:h" opt; do
+    case $opt in
+        n) HOSTS=$OPTARG ;;
+        i) INTERVAL=$OPTARG ;;
+        d) MAX_DELAY=$OPTARG ;;
+        r) RTT=$OPTARG ;;
+        l) LOSS=$OPTARG ;;
+        s) THREADS=$OPTARG ;;
+        t) DURATION=$OPTARG ;;
+        w) WATCHED=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+BENCH_DIR=$(dirname "$0")
+MONITOR=$BENCH_DIR/../icmpmonitor
+REFLECTOR=$BENCH_DIR/reflector
+DEVICE=icmpbench0
+WORK=$(mktemp -d /tmp/icmpbench.XXXXXX)
+
+# Synthetic hosts take 10.200.1.0 onward, and watched hosts 10.201.0.1 onward.
+write_config() { # <file> <hosts> <watched>
+    awk -v hosts="$2" -v watched="$3" -v interval="$INTERVAL" -v max_delay="$MAX_DELAY" -v down_log="$WORK/down.log" 'BEGIN {
+        for (i = 0; i < hosts; i++) {
+            n = 256 + i
+            printf "[host%d]\nhost = 10.200.%d.%d\n", i, int(n / 256), n % 256
+            printf "interval = %s\nmax_delay = %s\nstart_condition = up\n", interval, max_delay
+            printf "up_cmd = \"true\"\ndown_cmd = \"true\"\n"
+        }
+        for (i = 1; i <= watched; i++) {
+            printf "[watched%d]\nhost = 10.201.0.%d\n", i, i
+            printf "interval = %s\nmax_delay = %s\nstart_condition = up\n", interval, max_delay
+            printf "up_cmd = \"true\"\ndown_cmd = \"echo %d $(date +%%s%%N) >> %s\"\n", i, down_log
+        }
+    }' > "$1"
+}
+
+seconds() { # <duration>, as given in config files
+    echo "$1" | awk '{ v = $0 + 0; if ($0 ~ /ms$/) v /= 1000; print v }'
+}
+
+rss_kb() { # <pid>
+    awk '/^VmRSS:/ { print $2 }' "/proc/$1/status"
+}
+
+# Watched hosts, each with the time of its first DOWN command since the blackhole.
+detected() {
+    awk -v since="$BLACKHOLED" '$2 >= since && !seen[$1]++' "$WORK/down.log"
+}
+
+cpu_ticks() { # <pid>
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+# Reflector counts are requested with SIGUSR2 and printed to its log.
+requests_seen() {
+    lines=$(wc -l < "$WORK/reflector.log")
+    kill -USR2 "$REFLECTOR_PID"
+    while [ "$(wc -l < "$WORK/reflector.log")" -le "$lines" ]; do sleep 0.1; done
+    tail -n 1 "$WORK/reflector.log" | awk '{ print $2 }'
+}
+
+check_monitor() {
+    if ! kill -0 "$MONITOR_PID" 2> /dev/null; then
+        echo "ERROR: icmpmonitor exited early."
+        exit 1
+    fi
+}
+
+cleanup() {
+    [ -n "$MONITOR_PID" ] && kill "$MONITOR_PID" 2> /dev/null
+    [ -n "$REFLECTOR_PID" ] && kill "$REFLECTOR_PID" 2> /dev/null
+    wait
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+if [ "$(id -u)" != 0 ]; then
+    echo "ERROR: The benchmark must run as root to create a TUN device."
+    exit 1
+fi
+if [ ! -x "$MONITOR" ] || [ ! -x "$REFLECTOR" ]; then
+    echo "ERROR: Build with 'make bench' first."
+    exit 1
+fi
+
+"$REFLECTOR" -i $DEVICE -r "$RTT" -l "$LOSS" -b 10.201.0.0/24 > "$WORK/reflector.log" &
+REFLECTOR_PID=$!
+while ! ip link show $DEVICE > /dev/null 2>&1; do sleep 0.1; done
+ip addr add 10.200.0.1/16 dev $DEVICE
+ip link set $DEVICE up
+ip route add 10.201.0.0/24 dev $DEVICE
+
+# Memory per host is measured against a monitor with a single host.
+write_config "$WORK/one.ini" 1 0
+"$MONITOR" -s "$THREADS" -f "$WORK/one.ini" > /dev/null &
+MONITOR_PID=$!
+sleep 2
+check_monitor
+BASE_RSS=$(rss_kb $MONITOR_PID)
+kill $MONITOR_PID
+wait $MONITOR_PID 2> /dev/null
+
+write_config "$WORK/bench.ini" "$HOSTS" "$WATCHED"
+"$MONITOR" -s "$THREADS" -f "$WORK/bench.ini" > "$WORK/monitor.log" &
+MONITOR_PID=$!
+
+# Let the first pings spread out before measuring.
+sleep $(awk -v i="$(seconds "$INTERVAL")" -v d="$(seconds "$MAX_DELAY")" 'BEGIN { print (i > d ? i : d) + 1 }')
+check_monitor
+REQUESTS_START=$(requests_seen)
+CPU_START=$(cpu_ticks $MONITOR_PID)
+sleep "$DURATION"
+REQUESTS_END=$(requests_seen)
+CPU_END=$(cpu_ticks $MONITOR_PID)
+RSS=$(rss_kb $MONITOR_PID)
+
+# Blackhole the watched hosts and time each DOWN command.
+: > "$WORK/down.log"
+BLACKHOLED=$(date +%s%N)
+kill -USR1 $REFLECTOR_PID
+DEADLINE=$(awk -v now="$(date +%s)" -v d="$(seconds "$MAX_DELAY")" 'BEGIN { print int(now + d + 10) }')
+while [ "$(detected | wc -l)" -lt "$WATCHED" ] && [ "$(date +%s)" -lt "$DEADLINE" ]; do sleep 0.2; done
+
+detected | awk -v hosts="$HOSTS" -v watched="$WATCHED" -v duration="$DURATION" -v hz="$(getconf CLK_TCK)" \
+    -v requests="$((REQUESTS_END - REQUESTS_START))" -v ticks="$((CPU_END - CPU_START))" \
+    -v rss="$RSS" -v base_rss="$BASE_RSS" -v blackholed="$BLACKHOLED" '
+    { latency = ($2 - blackholed) / 1e6; total += latency; if (latency > max) max = latency; detected++ }
+    END {
+        total_hosts = hosts + watched
+        printf "Hosts:              %d\n", total_hosts
+        printf "Probes/sec:         %.0f\n", requests / duration
+        if (requests) printf "CPU per probe:      %.2f us\n", ticks / hz * 1e6 / requests
+        printf "CPU utilization:    %.1f%%\n", ticks / hz * 100 / duration
+        printf "Memory per host:    %.0f bytes (%d KiB resident)\n", (rss - base_rss) * 1024 / total_hosts, rss
+        if (detected) printf "Detection latency:  %.0f ms average, %.0f ms worst (%d of %d hosts)\n", total / detected, max, detected, watched
+        else printf "Detection latency:  no watched host detected down\n"
+    }'
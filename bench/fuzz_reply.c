@@ -0,0 +1,96 @@
+/*
+ * ICMPmonitor reply parser fuzz target
+ *
+ * Feeds arbitrary packets to parse_echo_reply(), as read from each kind of
+ * socket, and checks the checksum implementation init_checksum() picks for
+ * this CPU against checksum_sum_scalar(). Built for libFuzzer by `make
+ * fuzz`, or with FUZZ_STANDALONE for afl-fuzz and for replaying the files
+ * named on the command line.
+ *
+ * See LICENSE file for copyright and license details.
+ */
+
+#define NO_MAIN
+#include "../icmpmonitor.c"
+
+/* Largest input read by the standalone driver, that of an IPv4 packet. */
+#define MAX_INPUT_BYTES         IP_MAXPACKET
+
+int
+LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+    /* Raw IPv4 sockets, datagram IPv4 sockets and IPv6 sockets respectively. */
+    static const struct { bool ip_header; int reply_type; } sockets[] = {
+        { true,  ICMP_ECHOREPLY },
+        { false, ICMP_ECHOREPLY },
+        { false, ICMP6_ECHO_REPLY }
+    };
+    static bool initialized = false;
+    if (!initialized) {
+        init_checksum();
+        initialized = true;
+    }
+
+    /* Folded as checksum() does, the scalar sum must give the same result. */
+    uint64_t sum = checksum_sum_scalar(data, size);
+    while (sum > 0xffff) sum = (sum & 0xffff) + (sum >> 16);
+    assert(checksum(data, size) == (uint16_t) ~sum);
+
+    for (size_t i = 0; i < sizeof(sockets) / sizeof(sockets[0]); i++) {
+        struct echo_reply reply;
+        if (parse_echo_reply(data, size, sockets[i].ip_header, sockets[i].reply_type, &reply) != REPLY_ECHO) continue;
+
+        /* The echo data handed to process_icmp_packet() must be the tail of the packet. */
+        assert(reply.data >= data && reply.data + reply.data_bytes == data + size);
+        volatile unsigned char sink = 0;
+        for (size_t j = 0; j < reply.data_bytes; j++) sink ^= reply.data[j];
+    }
+    return 0;
+}
+
+#if defined(FUZZ_STANDALONE)
+/*
+ * Run each file named on the command line, or else standard input, through
+ * the target. Inputs are copied to buffers of their exact size, so that any
+ * overread trips AddressSanitizer.
+ */
+void
+run_input(FILE * file, const char * name)
+{
+    unsigned char * buffer = malloc(MAX_INPUT_BYTES);
+    if (buffer == NULL) {
+        fprintf(stderr, "ERROR: Unable to allocate input buffer.\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t size = fread(buffer, 1, MAX_INPUT_BYTES, file);
+    if (ferror(file)) {
+        fprintf(stderr, "ERROR: Unable to read %s.\n", name);
+        exit(EXIT_FAILURE);
+    }
+    unsigned char * input = malloc(size ? size : 1);
+    if (input == NULL) {
+        fprintf(stderr, "ERROR: Unable to allocate input buffer.\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(input, buffer, size);
+    free(buffer);
+    LLVMFuzzerTestOneInput(input, size);
+    free(input);
+}
+
+int
+main(int argc, char ** argv)
+{
+    if (argc < 2) run_input(stdin, "standard input");
+    for (int i = 1; i < argc; i++) {
+        FILE * file = fopen(argv[i], "rb");
+        if (file == NULL) {
+            fprintf(stderr, "ERROR: Unable to open %s.\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+        run_input(file, argv[i]);
+        fclose(file);
+    }
+    exit(EXIT_SUCCESS);
+}
+#endif
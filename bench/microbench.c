@@ -0,0 +1,229 @@
+/*
+ * ICMPmonitor microbenchmarks
+ *
+ * Times the per-packet hot paths: checksums, parsing and demultiplexing
+ * echo replies, and the iniparser dictionary lookups used to match hosts by
+ * label. Each benchmark is repeated until it has run for at least
+ * MIN_BENCH_TIME, as Google Benchmark does, and reported per iteration.
+ * Built and run by `make microbench`.
+ *
+ * See LICENSE file for copyright and license details.
+ */
+
+#define NO_MAIN
+#include "../icmpmonitor.c"
+
+#define MIN_BENCH_TIME          (USEC_PER_SEC / 2)
+#define BENCH_NAME_BYTES        64
+
+/* Inputs prepared for a benchmark before it is timed. */
+struct bench_context {
+    unsigned char *       data;
+    size_t                bytes;
+    union host_addr *     addrs;     /* Reply sources, in lookup order. */
+    unsigned char **      replies;   /* Echo replies, IPv4 header included, in lookup order. */
+    size_t                count;
+    dictionary *          labels;
+    char **               keys;      /* Labels, in lookup order. */
+};
+
+/* Results are accumulated here, so no benchmark's work can be optimized away. */
+volatile uint64_t bench_sink = 0;
+
+void
+bench_checksum(struct bench_context * context, uint64_t iterations)
+{
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        context->data[0] = i; /* As pinger() patches each probe, and so the call can't be hoisted. */
+        sum += checksum(context->data, context->bytes);
+    }
+    bench_sink += sum;
+}
+
+void
+bench_checksum_scalar(struct bench_context * context, uint64_t iterations)
+{
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        context->data[0] = i;
+        sum += checksum_sum_scalar(context->data, context->bytes);
+    }
+    bench_sink += sum;
+}
+
+void
+bench_parse_echo_reply(struct bench_context * context, uint64_t iterations)
+{
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        struct echo_reply reply;
+        if (parse_echo_reply(context->replies[i % context->count], ICMP_ECHO_PACKET_BYTES + IPV4_HEADER_BYTES,
+                             true, ICMP_ECHOREPLY, &reply) == REPLY_ECHO) {
+            sum += reply.ident;
+        }
+    }
+    bench_sink += sum;
+}
+
+void
+bench_reply_demux(struct bench_context * context, uint64_t iterations)
+{
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        size_t n = i % context->count;
+        struct echo_reply reply;
+        if (parse_echo_reply(context->replies[n], ICMP_ECHO_PACKET_BYTES + IPV4_HEADER_BYTES,
+                             true, ICMP_ECHOREPLY, &reply) == REPLY_ECHO) {
+            sum += (uintptr_t) host_hash_lookup(&context->addrs[n], reply.ident);
+        }
+    }
+    bench_sink += sum;
+}
+
+void
+bench_dictionary_get(struct bench_context * context, uint64_t iterations)
+{
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        sum += (uintptr_t) dictionary_get(context->labels, context->keys[i % context->count], NULL);
+    }
+    bench_sink += sum;
+}
+
+/*
+ * Time `bench`, doubling its iterations until a run lasts MIN_BENCH_TIME.
+ */
+void
+run_bench(const char * name, void (*bench)(struct bench_context *, uint64_t), struct bench_context * context)
+{
+    uint64_t iterations = 1, elapsed = 0;
+    while (true) {
+        uint64_t start = monotonic_usec();
+        bench(context, iterations);
+        elapsed = monotonic_usec() - start;
+        if (elapsed >= MIN_BENCH_TIME) break;
+        iterations *= 2;
+    }
+    printf("%-32s %12.1f ns %14llu\n", name, elapsed * 1000.0 / iterations, (unsigned long long) iterations);
+    fflush(stdout);
+}
+
+/*
+ * Build a shard of `count` resolved IPv4 hosts, like init_hosts() would, and
+ * an echo reply from each, visited in a shuffled order in `context`.
+ */
+void
+build_demux_context(struct bench_context * context, size_t count)
+{
+    host_table  = calloc(count, sizeof(struct host_entry));
+    total_hosts = count;
+    shard_count = 1;
+    init_shards();
+
+    context->count   = count;
+    context->addrs   = calloc(count, sizeof(union host_addr));
+    context->replies = calloc(count, sizeof(unsigned char *));
+    if (host_table == NULL || context->addrs == NULL || context->replies == NULL) {
+        fprintf(stderr, "ERROR: Unable to allocate hosts.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < count; i++) {
+        struct host_entry * host = &host_table[i];
+        host->dest.v4.sin_family      = AF_INET;
+        host->dest.v4.sin_addr.s_addr = htonl(0x0A000000 + i);
+        host->resolved = true;
+        assign_ident(host);
+    }
+    build_host_hash();
+
+    for (size_t i = 0; i < count; i++) {
+        size_t n = (i * 7919) % count; /* A prime stride, a shuffle of sorts when coprime with `count`. */
+        struct host_entry * host = &host_table[n];
+        context->addrs[i] = host->dest;
+        if ((context->replies[i] = calloc(1, IPV4_HEADER_BYTES + ICMP_ECHO_PACKET_BYTES)) == NULL) {
+            fprintf(stderr, "ERROR: Unable to allocate replies.\n");
+            exit(EXIT_FAILURE);
+        }
+        unsigned char * packet = context->replies[i];
+        packet[0] = 0x45; /* IPv4, with a 20 byte header. */
+        packet[IPV4_HEADER_BYTES] = ICMP_ECHOREPLY;
+        memcpy(packet + IPV4_HEADER_BYTES + 4, &host->ident, sizeof(host->ident));
+    }
+}
+
+void
+free_demux_context(struct bench_context * context)
+{
+    for (size_t i = 0; i < context->count; i++) free(context->replies[i]);
+    free(context->replies);
+    free(context->addrs);
+    free(shard->host_hash);
+    free(shard->ranges);
+    free(shards);
+    free(host_table);
+    host_table = NULL;
+}
+
+int
+main(void)
+{
+    init_checksum();
+    printf("%-32s %15s %14s\n", "Benchmark", "Time", "Iterations");
+
+    char name[BENCH_NAME_BYTES];
+    struct bench_context context;
+    memset(&context, 0, sizeof(context));
+
+    /* Default pings, small and typical MTU probes, and jumbo frames. */
+    static const size_t checksum_bytes[] = { ICMP_ECHO_PACKET_BYTES, 64, 576, 1500, 9000 };
+    for (size_t i = 0; i < sizeof(checksum_bytes) / sizeof(checksum_bytes[0]); i++) {
+        context.bytes = checksum_bytes[i];
+        if ((context.data = malloc(context.bytes)) == NULL) {
+            fprintf(stderr, "ERROR: Unable to allocate packet.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t j = 0; j < context.bytes; j++) context.data[j] = j * 31;
+        snprintf(name, sizeof(name), "checksum/%zu", context.bytes);
+        run_bench(name, bench_checksum, &context);
+        snprintf(name, sizeof(name), "checksum_sum_scalar/%zu", context.bytes);
+        run_bench(name, bench_checksum_scalar, &context);
+        free(context.data);
+    }
+
+    /* Reply demultiplexing, with a hash table fitting in cache and one which doesn't. */
+    static const size_t host_counts[] = { 1000, 100000 };
+    for (size_t i = 0; i < sizeof(host_counts) / sizeof(host_counts[0]); i++) {
+        build_demux_context(&context, host_counts[i]);
+        snprintf(name, sizeof(name), "parse_echo_reply/%zu", host_counts[i]);
+        run_bench(name, bench_parse_echo_reply, &context);
+        snprintf(name, sizeof(name), "reply_demux/%zu", host_counts[i]);
+        run_bench(name, bench_reply_demux, &context);
+        free_demux_context(&context);
+    }
+
+    /* Section label lookups, as when reloading a config of as many hosts. */
+    for (size_t i = 0; i < sizeof(host_counts) / sizeof(host_counts[0]); i++) {
+        size_t count = host_counts[i];
+        context.count  = count;
+        context.labels = dictionary_new(count);
+        context.keys   = calloc(count, sizeof(char *));
+        if (context.labels == NULL || context.keys == NULL) {
+            fprintf(stderr, "ERROR: Unable to allocate labels.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t j = 0; j < count; j++) {
+            char label[BENCH_NAME_BYTES];
+            snprintf(label, sizeof(label), "host %zu", (j * 7919) % count);
+            context.keys[j] = strdup(label);
+            dictionary_set(context.labels, label, "0");
+        }
+        snprintf(name, sizeof(name), "dictionary_get/%zu", count);
+        run_bench(name, bench_dictionary_get, &context);
+        for (size_t j = 0; j < count; j++) free(context.keys[j]);
+        free(context.keys);
+        dictionary_del(context.labels);
+    }
+
+    exit(EXIT_SUCCESS);
+}
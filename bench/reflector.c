@@ -0,0 +1,285 @@
+/*
+ * ICMPmonitor benchmark reflector
+ *
+ * Answers the ICMP echo requests routed into a TUN device, standing in for
+ * any number of hosts, after a chosen round trip time and with a chosen
+ * packet loss. Used by `bench.sh`. Linux only.
+ *
+ * See LICENSE file for copyright and license details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+
+#define USEC_PER_SEC            1000000
+#define USEC_PER_MSEC           1000
+
+/* Packets larger than a default TUN MTU are not echoed. */
+#define SLOT_BYTES              1500
+#define DEFAULT_QUEUE_SLOTS     16384
+#define DEFAULT_DEVICE          "icmpbench0"
+
+/* Packets read from the device per wakeup, at most. */
+#define READ_BURST              256
+
+/* A reply waiting out the round trip time. Replies all wait equally long, so leave in order. */
+struct delayed_reply {
+    uint64_t      due;
+    size_t        bytes;
+    unsigned char packet[SLOT_BYTES];
+};
+
+/* Globals */
+    /* Set by signal handlers. */
+    volatile sig_atomic_t  blackhole_active = false;
+    volatile sig_atomic_t  counts_requested = false;
+    volatile sig_atomic_t  exit_requested   = false;
+
+    /* Set by command line flags. */
+    uint64_t               round_trip       = 0; /* Microseconds. */
+    double                 loss             = 0; /* Fraction of requests dropped at random. */
+    uint32_t               blackhole_net    = 0; /* Host byte order. */
+    uint32_t               blackhole_mask   = 0; /* Zero if no blackhole was given. */
+    size_t                 queue_slots      = DEFAULT_QUEUE_SLOTS;
+
+    /* Ring of replies not yet due, from `queue_head` for `queue_length` slots. */
+    struct delayed_reply * queue            = NULL;
+    size_t                 queue_head       = 0;
+    size_t                 queue_length     = 0;
+
+    unsigned long long     requests         = 0;
+    unsigned long long     replies          = 0;
+    unsigned long long     lost             = 0;
+    unsigned long long     blackholed       = 0;
+    unsigned long long     overflowed       = 0; /* Dropped for want of a queue slot. */
+
+uint64_t
+monotonic_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+void
+toggle_blackhole(int ignore) /* Dummy parameter since this function registers as a signal handler. */
+{
+    blackhole_active = !blackhole_active;
+}
+
+void
+request_counts(int ignore) /* Dummy parameter since this function registers as a signal handler. */
+{
+    counts_requested = true;
+}
+
+void
+request_exit(int ignore) /* Dummy parameter since this function registers as a signal handler. */
+{
+    exit_requested = true;
+}
+
+void
+print_counts(void)
+{
+    printf("requests %llu replies %llu lost %llu blackholed %llu overflowed %llu\n",
+           requests, replies, lost, blackholed, overflowed);
+    fflush(stdout);
+}
+
+/*
+ * Create the TUN device `name`, returning its file descriptor.
+ */
+int
+open_tun(const char * name)
+{
+    int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Unable to open /dev/net/tun: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        fprintf(stderr, "ERROR: Unable to create TUN device %s: %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/*
+ * Turn the echo request of `bytes` bytes at `packet` into its reply. Returns
+ * false if the packet is no echo request or should go unanswered.
+ */
+bool
+make_reply(unsigned char * packet, size_t bytes)
+{
+    struct ip * ip = (struct ip *) packet;
+    if (bytes < sizeof(struct ip) || ip->ip_v != 4 || ip->ip_p != IPPROTO_ICMP) return false;
+    size_t header_bytes = ip->ip_hl << 2;
+    if (header_bytes < sizeof(struct ip) || bytes < header_bytes + ICMP_MINLEN) return false;
+    struct icmp * icmp = (struct icmp *) (packet + header_bytes);
+    if (icmp->icmp_type != ICMP_ECHO || icmp->icmp_code != 0) return false;
+    requests++;
+
+    if (blackhole_mask && blackhole_active && (ntohl(ip->ip_dst.s_addr) & blackhole_mask) == blackhole_net) {
+        blackholed++;
+        return false;
+    }
+    if (loss > 0 && drand48() < loss) {
+        lost++;
+        return false;
+    }
+
+    /* Swapping addresses leaves the IP checksum as it was. */
+    struct in_addr dst = ip->ip_dst;
+    ip->ip_dst = ip->ip_src;
+    ip->ip_src = dst;
+
+    /* Only the type changes, so the checksum is updated incrementally (RFC 1624). */
+    uint32_t sum = (uint16_t) ~ntohs(icmp->icmp_cksum) + (uint16_t) ~(ICMP_ECHO << 8) + (ICMP_ECHOREPLY << 8);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    icmp->icmp_type  = ICMP_ECHOREPLY;
+    icmp->icmp_cksum = htons(~sum & 0xffff);
+    return true;
+}
+
+void
+print_usage(char ** argv)
+{
+    printf( "Usage: %s [-h] [-i <device>] [-r <ms>] [-l <percent>] [-b <network>/<prefix>] [-q <slots>]\n"
+            "  -i <device>  Name of the TUN device to create (default %s).\n"
+            "  -r <ms>      Delay each reply by <ms> milliseconds (default 0).\n"
+            "  -l <percent> Drop <percent> of echo requests at random (default 0).\n"
+            "  -b <net>     Stop answering hosts in <net>, e.g. 10.201.0.0/24, at each SIGUSR1 (toggles).\n"
+            "  -q <slots>   Hold at most <slots> delayed replies (default %d).\n"
+            "  -h           Help (prints this message)\n"
+            "Counts are printed to stdout at each SIGUSR2 and on exit.\n"
+            , argv[0], DEFAULT_DEVICE, DEFAULT_QUEUE_SLOTS);
+}
+
+void
+parse_params(int argc, char ** argv, const char ** device)
+{
+    int param;
+    char * prefix;
+    struct in_addr net;
+    while ((param = getopt(argc, argv, "hi:r:l:b:q:")) != -1) {
+        switch(param) {
+            case 'i':
+                *device = optarg;
+                break;
+            case 'r':
+                round_trip = atof(optarg) * USEC_PER_MSEC;
+                break;
+            case 'l':
+                loss = atof(optarg) / 100;
+                break;
+            case 'b':
+                if ((prefix = strchr(optarg, '/')) == NULL || atoi(prefix + 1) < 1 || atoi(prefix + 1) > 32) {
+                    fprintf(stderr, "ERROR: Blackhole must be given as <network>/<prefix>.\n");
+                    exit(EXIT_FAILURE);
+                }
+                *prefix = '\0';
+                if (inet_pton(AF_INET, optarg, &net) != 1) {
+                    fprintf(stderr, "ERROR: Invalid blackhole network %s.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                blackhole_mask = UINT32_MAX << (32 - atoi(prefix + 1));
+                blackhole_net  = ntohl(net.s_addr) & blackhole_mask;
+                break;
+            case 'q':
+                if (atoi(optarg) < 1) {
+                    fprintf(stderr, "ERROR: Queue must hold at least 1 reply.\n");
+                    exit(EXIT_FAILURE);
+                }
+                queue_slots = atoi(optarg);
+                break;
+            case 'h':
+            default:
+                print_usage(argv);
+                exit(EXIT_FAILURE);
+                break;
+        }
+    }
+}
+
+int
+main(int argc, char ** argv)
+{
+    const char * device = DEFAULT_DEVICE;
+    parse_params(argc, argv, &device);
+
+    if ((queue = malloc(queue_slots * sizeof(struct delayed_reply))) == NULL) {
+        fprintf(stderr, "ERROR: Unable to allocate reply queue.\n");
+        exit(EXIT_FAILURE);
+    }
+    int fd = open_tun(device);
+    srand48(getpid());
+
+    signal(SIGUSR1, toggle_blackhole);
+    signal(SIGUSR2, request_counts);
+    signal(SIGINT, request_exit);
+    signal(SIGTERM, request_exit);
+
+    struct delayed_reply scratch;
+    while (!exit_requested) {
+        /* Send the replies now due. */
+        uint64_t now = monotonic_usec();
+        while (queue_length && queue[queue_head].due <= now) {
+            if (write(fd, queue[queue_head].packet, queue[queue_head].bytes) > 0) replies++;
+            queue_head = (queue_head + 1) % queue_slots;
+            queue_length--;
+        }
+        if (counts_requested) {
+            counts_requested = false;
+            print_counts();
+        }
+
+        int timeout = -1;
+        if (queue_length) timeout = (queue[queue_head].due - now + USEC_PER_MSEC - 1) / USEC_PER_MSEC;
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+            fprintf(stderr, "ERROR: Polling TUN device: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        /* Requests are read straight into the next free slot. */
+        for (int i = 0; i < READ_BURST; i++) {
+            struct delayed_reply * slot = &scratch;
+            if (queue_length < queue_slots) slot = &queue[(queue_head + queue_length) % queue_slots];
+            ssize_t bytes = read(fd, slot->packet, SLOT_BYTES);
+            if (bytes < 0) break;
+            if (!make_reply(slot->packet, bytes)) continue;
+            if (slot == &scratch) {
+                overflowed++;
+                continue;
+            }
+            slot->bytes = bytes;
+            slot->due   = monotonic_usec() + round_trip;
+            queue_length++;
+        }
+    }
+
+    print_counts();
+    exit(EXIT_SUCCESS);
+}
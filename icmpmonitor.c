@@ -12,19 +12,30 @@
  */
 
 /* Wishlist */
-/* TODO: Add IPv6 support. */
-/* TODO: Turn the global '-r' functionality into per-host config file option. */
-/* TODO: Add 'auto' keyword to 'start_condition', testing host on startup. */
 /* TODO: Double-check the network code when interrupted while receiving a packet. */
 
+/* Batched socket I/O via sendmmsg() and recvmmsg(). Define NO_MMSG when compiling to use */
+/* one sendto() or recvfrom() per packet instead.                                          */
+#if defined(__linux__)
+    #define _GNU_SOURCE
+    #if !defined(NO_MMSG)
+        #define HAVE_MMSG
+    #endif
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <signal.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <netinet/in.h>
@@ -32,331 +43,4461 @@
 #include <netdb.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+/* OpenBSD's resolver is thread-safe without the reentrant res_n*() interface. */
+#if !defined(__OpenBSD__)
+    #define HAVE_RES_NQUERY
+#endif
+
+/* Linux reports kernel and NIC transmit timestamps through the socket error queue, */
+/* and can filter incoming packets with classic BPF before they reach userspace.     */
+#if defined(__linux__)
+    #include <linux/net_tstamp.h>
+    #include <linux/errqueue.h>
+    #include <linux/filter.h>
+#endif
+
+/* Select an event notification backend: epoll on Linux, kqueue on the BSDs, poll() elsewhere. */
+/* Define EVENT_BACKEND_POLL when compiling to force the portable poll() backend.               */
+#if defined(EVENT_BACKEND_POLL)
+    #include <poll.h>
+#elif defined(__linux__)
+    #define EVENT_BACKEND_EPOLL
+    #include <sys/epoll.h>
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__) || defined(__APPLE__)
+    #define EVENT_BACKEND_KQUEUE
+    #include <sys/event.h>
+#else
+    #define EVENT_BACKEND_POLL
+    #include <poll.h>
+#endif
+
+/* Control of the don't fragment bit, toggled on each socket between runs of probes. Linux */
+/* must also ignore its cached path MTU, so that our probes actually test the path.       */
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE) && defined(IPV6_DONTFRAG)
+    #define HAVE_DONT_FRAGMENT
+#elif defined(IP_DONTFRAG) && defined(IPV6_DONTFRAG)
+    #define HAVE_DONT_FRAGMENT
+#endif
+
+/* Vectorized checksums. SSE2 and NEON are used when the compiler targets them. With GCC or */
+/* Clang on x86, AVX2 is also built and chosen at runtime on CPUs which support it.           */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>
+    #define HAVE_CHECKSUM_AVX2
+    #if defined(__SSE2__)
+        #define HAVE_CHECKSUM_SSE2
+    #endif
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+    #define HAVE_CHECKSUM_NEON
+#endif
+
+#include "iniparser/iniparser.h"
+
+#define VERSION 2
+
+/* ICMP header contains: type, code, checksum, identifier and sequence number. */
+#define ICMP_ECHO_HEADER_BYTES  8
+#define ICMP_ECHO_DATA_BYTES    sizeof(struct timeval)
+#define ICMP_ECHO_PACKET_BYTES  (ICMP_ECHO_HEADER_BYTES + ICMP_ECHO_DATA_BYTES)
+
+/* Only the sequence number and timestamp, from this 16-bit word onwards, differ between probes. */
+#define PROBE_FIRST_VARYING_WORD 3
+#define PROBE_VARYING_WORDS      (ICMP_ECHO_PACKET_BYTES / 2 - PROBE_FIRST_VARYING_WORD)
+
+/* Echo data beyond the timestamp is padding, up to the largest payload an IPv4 packet allows. */
+#define MAX_PAYLOAD_BYTES       65507
+#define IPV4_HEADER_BYTES       20
+#define IPV6_HEADER_BYTES       40
+
+/* Path MTU searches assume the minimum MTU of each IP version gets through.      */
+/* A size is only deemed too large once PMTU_PROBE_ATTEMPTS probes of it are lost. */
+#define PMTU_MIN_IPV4           68
+#define PMTU_MIN_IPV6           1280
+#define DEFAULT_PMTU_MAX        1500
+#define PMTU_PROBE_ATTEMPTS     3
+#define PMTU_PROBE_TIMEOUT      USEC_PER_SEC
+#define PMTU_SEARCH_INTERVAL    (60 * USEC_PER_SEC)
+/* A path MTU below `pmtu_max` is only searched above again this often. */
+#define PMTU_FULL_SEARCH_INTERVAL (10 * 60 * USEC_PER_SEC)
+
+/* Ping outcomes tracked by the `loss_window` state machine, one bit each. */
+#define MAX_LOSS_WINDOW         64
+
+/* Hosts unreachable while their parents are down are pinged this many times less often. */
+#define UNREACHABLE_BACKOFF     4
+#define MAX_PARENT_LABEL_BYTES  256
+
+/* Receive buffers need only hold the largest IP header (60 bytes) plus one of our echo packets. */
+/* IPv6 raw sockets deliver ICMPv6 packets without their IP header.                            */
+#define ICMP_REPLY_BUFFER_BYTES 128
+
+/* RTT histogram bucket N counts replies taking less than 2^(N+1) microseconds. The last */
+/* bucket also counts anything slower.                                                  */
+#define RTT_HISTOGRAM_BUCKETS   24
+
+/* Space for the timestamp control messages attached to one received packet. */
+#define TIMESTAMP_CONTROL_BYTES 256
+
+/* Transmit timestamps are matched to probes by send order. Must exceed the number of probes */
+/* whose timestamps can be outstanding in the socket error queue at once.                     */
+#define TX_RING_SIZE            4096
+
+/* Default limit on up/down commands running at once. Further commands wait in a queue. */
+#define DEFAULT_MAX_CHILDREN    16
+/* Commands arriving while this many are already queued are dropped with a warning. */
+#define MAX_QUEUED_COMMANDS     4096
+
+/* Commands containing none of these characters are split on whitespace and executed */
+/* directly rather than through `/bin/sh -c`.                                        */
+#define SHELL_METACHARACTERS    "|&;<>()$`\\\"'*?[]#~=%{}!\n"
+#define MAX_DIRECT_ARGS         32
+
+/* Environment variables through which the `-b` batch command receives coalesced hosts. */
+#define BATCH_ENV_UP            "ICMPMONITOR_UP="
+#define BATCH_ENV_DOWN          "ICMPMONITOR_DOWN="
+
+/* Default limits on concurrent hostname lookups and the time allowed for each one. */
+#define DEFAULT_MAX_LOOKUPS     8
+#define DEFAULT_LOOKUP_TIMEOUT  (5 * USEC_PER_SEC)
+/* Delay before retrying a hostname which failed to resolve. */
+#define LOOKUP_RETRY_INTERVAL   (30 * USEC_PER_SEC)
+/* Resolved hostnames are refreshed when their DNS TTL expires, clamped to these bounds. */
+/* Names whose TTL can't be determined are refreshed every DEFAULT_ADDR_TTL.            */
+#define MIN_ADDR_TTL            (5 * USEC_PER_SEC)
+#define MAX_ADDR_TTL            (3600 * (uint64_t) USEC_PER_SEC)
+#define DEFAULT_ADDR_TTL        (300 * USEC_PER_SEC)
+/* Large enough for any DNS response to a query for A or AAAA records. */
+#define DNS_ANSWER_MAX_BYTES    4096
+
+/* The `-p` state file starts with this magic number and format version, and is refreshed by */
+/* each shard every STATE_SAVE_INTERVAL. Hosts restored as up get at least RESTORE_GRACE to  */
+/* answer the startup sweep before being declared down.                                      */
+#define STATE_FILE_MAGIC        0x534d4349 /* "ICMS" in little-endian order. */
+#define STATE_FILE_VERSION      1
+#define STATE_SAVE_INTERVAL     (10 * USEC_PER_SEC)
+#define RESTORE_GRACE           USEC_PER_SEC
+
+/* With `-m`, metrics are pushed as StatsD lines every METRICS_INTERVAL, packed into UDP */
+/* datagrams of at most METRICS_PACKET_BYTES. Counters written by different threads are  */
+/* kept CACHE_LINE_BYTES apart.                                                          */
+#define METRICS_INTERVAL        (10 * USEC_PER_SEC)
+#define METRICS_PACKET_BYTES    1432
+#define METRICS_PREFIX          "icmpmonitor."
+#define CACHE_LINE_BYTES        64
+
+/* With `-e`, every probe outcome is queued in a per-shard ring of EVENT_RING_RECORDS records */
+/* (a power of two), polled every EVENT_LOG_POLL_INTERVAL by a writer thread. Log files are   */
+/* rotated at EVENT_LOG_ROTATE_BYTES. A lost Unix socket is retried every EVENT_LOG_RETRY.    */
+#define EVENT_LOG_MAGIC         0x454d4349 /* "ICME" in little-endian order. */
+#define EVENT_LOG_VERSION       1
+#define EVENT_RING_RECORDS      65536
+#define EVENT_LOG_POLL_INTERVAL (10 * USEC_PER_MSEC)
+#define EVENT_LOG_ROTATE_BYTES  (64 * 1024 * 1024)
+#define EVENT_LOG_RETRY         USEC_PER_SEC
+#define EVENT_LOG_UNIX_PREFIX   "unix:"
+
+/* Maximum number of packets sent or received by a single batched system call. */
+#define SEND_BATCH_SIZE         64
+#define RECV_BATCH_SIZE         64
+
+#define USEC_PER_SEC            1000000
+#define USEC_PER_MSEC           1000
+
+/* Marks a timer which is not currently in the scheduler heap. */
+#define TIMER_INACTIVE          SIZE_MAX
+
+/* Must be larger than the length of the longest configuration key (not value). */
+/* For example: MAX_CONF_KEY_LEN > strlen("start_condition")                    */
+#define MAX_CONF_KEY_LEN 	20
+
+/* Maximum number of file descriptors registered with the event backend. */
+#define MAX_EVENT_SOURCES       16
+/* Maximum number of ready events collected from the backend by a single wait. */
+#define EVENT_BATCH_SIZE        64
+
+/* Buckets in the reply demultiplexing table per host, rounded up to a power of two. */
+#define HOST_HASH_LOAD_FACTOR   2
+/* Each shard's range of ICMP identifiers leaves room for reloads to at least double its hosts. */
+#define MIN_IDENT_SPAN          1024
+
+/* A scheduled callback. Times are in microseconds on the monotonic clock. */
+struct timer {
+    uint64_t due;
+    size_t   heap_index;
+    void     (*callback)(void * context);
+    void *   context;
+};
+
+/* Realtime clock timestamps for one packet, zero where unavailable. Software timestamps   */
+/* come from the kernel (or userspace, as a fallback), hardware timestamps from the NIC. */
+struct packet_times {
+    struct timespec software;
+    struct timespec hardware;
+};
+
+/* Control message buffer, aligned as CMSG_FIRSTHDR() requires. */
+union control_buffer {
+    size_t        align;
+    unsigned char bytes[TIMESTAMP_CONTROL_BYTES];
+};
+
+/* Round trip time statistics, in microseconds. */
+struct rtt_stats {
+    uint64_t replies;
+    uint64_t total;
+    uint32_t min;
+    uint32_t max;
+    uint32_t last;
+    double   jitter; /* Smoothed mean deviation between successive RTTs, per RFC 3550. */
+    uint32_t histogram[RTT_HISTOGRAM_BUCKETS];
+};
+
+/* Header of the `-p` state file, followed by `record_count` records. The file is only read */
+/* back on the machine which wrote it, so everything is in native byte order.               */
+struct state_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t record_count;
+};
+
+/* Saved state of one host, found again on restart by the key from state_key(). */
+struct state_record {
+    uint64_t key;
+    uint64_t last_reply; /* Wall clock, in microseconds since the epoch. Zero if never. */
+    uint8_t  known;      /* Zero while a host starting in `auto` has yet to be settled. */
+    uint8_t  host_up;
+    uint8_t  reserved[6];
+};
+
+/* Counters kept by each host and each shard for the metrics flush. See counter_add(). */
+enum host_metric {
+    HOST_PROBES_SENT,
+    HOST_REPLIES,
+    HOST_TIMEOUTS,
+    HOST_RTT_TOTAL, /* Microseconds, over replies with a usable RTT. */
+    HOST_RTT_COUNT,
+    HOST_METRIC_COUNT
+};
+
+enum shard_metric {
+    SHARD_PROBES_SENT,
+    SHARD_SEND_ERRORS,
+    SHARD_REPLIES,
+    SHARD_TIMEOUTS,
+    SHARD_SHORT_PACKETS,
+    SHARD_FOREIGN_PACKETS,
+    SHARD_EVENTS_DROPPED, /* Event log records lost to a full ring. */
+    SHARD_METRIC_COUNT
+};
+
+struct host_metrics {
+    _Atomic uint64_t counts[HOST_METRIC_COUNT];
+    atomic_bool      up;                          /* Mirrors `host_up` for the main thread. */
+    uint64_t         reported[HOST_METRIC_COUNT]; /* As of the previous flush. Main thread only. */
+};
+
+struct shard_metrics {
+    _Atomic uint64_t counts[SHARD_METRIC_COUNT];
+    _Atomic uint64_t rtt_histogram[RTT_HISTOGRAM_BUCKETS]; /* Bucketed as in `struct rtt_stats`. */
+};
+
+/* Header written at the start of each `-e` event log file or socket connection, followed by */
+/* records. Everything is in native byte order.                                              */
+struct event_log_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_bytes;
+};
+
+enum event_outcome {
+    EVENT_SENT,
+    EVENT_SEND_ERROR,
+    EVENT_REPLY,
+    EVENT_TIMEOUT, /* `max_delay` passed with no reply. */
+    EVENT_UP,      /* The host's UP command ran. */
+    EVENT_DOWN,    /* The host's DOWN command ran. */
+    EVENT_UNREACHABLE /* The host went silent while its parents were down. */
+};
+
+/* One event log record. */
+struct event_record {
+    uint64_t time;   /* Wall clock, in microseconds since the epoch. */
+    uint32_t host;   /* The host's `number`. */
+    uint32_t rtt;    /* Microseconds, for replies with a usable RTT. Otherwise UINT32_MAX. */
+    uint16_t seq;    /* Sequence number of the probe concerned. */
+    uint8_t  outcome;
+    uint8_t  reserved[5];
+};
+
+/* Single producer, single consumer queue of event records from a shard to the writer thread. */
+struct event_ring {
+    _Alignas(CACHE_LINE_BYTES) _Atomic uint64_t head; /* Written by the shard. */
+    uint64_t              cached_tail;                /* The shard's last look at `tail`. */
+    _Alignas(CACHE_LINE_BYTES) _Atomic uint64_t tail; /* Written by the writer thread. */
+    struct event_record * records;
+};
+
+/* An IPv4 or IPv6 socket address. */
+union host_addr {
+    struct sockaddr     sa;
+    struct sockaddr_in  v4;
+    struct sockaddr_in6 v6;
+};
+
+/* A hostname lookup, passed from a shard to a resolver thread and back. */
+struct resolve_request {
+    char *                   name;
+    int                      family; /* Address family wanted, AF_UNSPEC for either. */
+    union host_addr          addr; /* Result, AF_UNSPEC on failure. Written by the resolver thread. */
+    uint32_t                 ttl;  /* Seconds, 0 if unknown. Written by the resolver thread. */
+    struct host_entry *      host; /* NULL once abandoned. Only used by the owning shard. */
+    struct shard *           shard; /* Shard to which the result is returned. */
+    struct resolve_request * next;
+};
+
+/*
+ * Monitoring state of one host, kept in the contiguous `host_table` or, for
+ * hosts added by a reload, an array allocated by that reload. Entries never
+ * move. Fields used on every ping sent or received come first. Configuration
+ * needed only for messages and commands lives apart, in `config`.
+ */
+struct host_entry {
+    /* Reply demultiplexing hash chain, keyed on destination address and ICMP identifier. */
+    union host_addr     dest;
+    uint16_t            ident;
+    struct host_entry * hash_next;
+
+    uint16_t            seq;
+    uint16_t            last_ping_seq;      /* Of the latest regular ping, in network byte order. PMTU probes use `seq` too. */
+    uint32_t            number;             /* Position in config order, for the event log. Reloads number on. */
+    bool                host_up;
+    bool                resolved;           /* Hosts aren't pinged until `dest` is resolved. */
+    bool                send_slot_reserved; /* Send timer was deferred to a rate limiter slot. */
+    bool                removed;            /* No longer monitored. The slot is left unused. */
+    bool                state_unknown;      /* Started in `auto` and not yet settled by a reply or deadline. */
+    bool                sweep_pending;      /* Started in `auto`, so ping at once when first activated. */
+    struct host_config * config;
+    uint64_t            ping_interval;      /* Microseconds, from the config file. */
+    uint64_t            max_delay;          /* Microseconds, from the config file. */
+    uint64_t            last_ping_received;
+    uint64_t            last_ping_sent;
+    uint64_t            next_ping_due;      /* Ignoring any deferral by the rate limiter. */
+    uint64_t            phase;              /* Offset of the first ping into the interval. */
+    bool                last_ping_answered;
+    uint64_t            unanswered_since;   /* When the first of the pings unanswered since the last reply was sent. */
+    bool                retry_down_cmd;     /* Repeat the DOWN command for each ping unanswered while down. */
+
+    /* Adaptive ping intervals, each 0 if not configured. */
+    uint64_t            max_down_interval;  /* Cap on the interval, doubling while the host is down. */
+    uint64_t            down_interval;      /* The current interval while backing off. */
+    uint64_t            confirm_interval;   /* Interval while up after a ping went unanswered. */
+
+    /* With `loss_window`, a bit per recent ping, most recent in bit 0, set if it got no reply. */
+    uint64_t            loss_bits;
+    uint8_t             loss_window;        /* Pings tracked, 0 to judge by `max_delay` alone. */
+    uint8_t             down_after;         /* Lost pings in the window which take the host down. */
+    uint8_t             up_after;           /* Replies in a row which bring the host back up. */
+    uint8_t             reply_streak;
+    bool                window_pending;     /* The last ping sent awaits judgment. */
+    bool                window_answered;    /* The last ping sent has been answered. */
+
+    /* Hosts named by the `parent` option, linked by link_parents(). */
+    struct host_entry ** parents;
+    size_t               parent_count;
+    atomic_bool          unreachable;       /* Went silent with every parent down. Read by children's shards. */
+    _Atomic uint64_t     last_reply;        /* As `last_ping_received`, but only ever set by replies. Read likewise. */
+
+    /* The previous probe, patched into the next one by pinger(). */
+    uint16_t *          probe;
+    size_t              probe_bytes;        /* From the `payload_size` config option. */
+    bool                probe_checksummed;  /* We, not the kernel, fill in the checksum. */
+    bool                dont_fragment;
+
+    /* Scheduler state */
+    struct timer        send_timer;
+    struct timer        deadline_timer;
+
+    /* Kernel transmit timestamps for the most recent probe which has them. */
+    bool                tx_stamped;
+    uint16_t            tx_seq;
+    struct packet_times tx_times;
+
+    struct rtt_stats    rtt;
+
+    /* Hostname resolution */
+    struct resolve_request * pending_lookup;
+    struct timer             resolve_timer; /* Lookup timeout, delay before retrying, or TTL expiry. */
+
+    /* This host's record in the state file, or NULL. */
+    struct state_record * state_record;
+
+    struct host_metrics metrics;
+
+    /* Path MTU discovery: a binary search for the largest packet answered, between `pmtu_low` and `pmtu_high`. */
+    unsigned char *     pmtu_packet;
+    struct timer        pmtu_timer;     /* Probe timeout, or the start of the next search. */
+    uint32_t            pmtu_low;       /* Zero between searches. */
+    uint32_t            pmtu_high;
+    uint32_t            pmtu_size;      /* Size of the probe in flight, or zero. */
+    uint16_t            pmtu_seq;
+    int                 pmtu_attempts;
+    uint32_t            path_mtu;       /* Result of the last search, or zero. */
+    uint64_t            pmtu_searched;  /* When the last full search finished. */
+    bool                pmtu_confirming; /* Probing `path_mtu` alone, as the last full search found it the limit. */
+    bool                pmtu_degraded;  /* Held down since `path_mtu` fell below `pmtu_min`. */
+};
+
+/* One struct per host as listed in the config file, at the same index as its `host_entry`. */
+struct host_config {
+    char * label; /* Section name in the config file. */
+    char * name;
+    char * up_cmd;
+    char * down_cmd;
+    int    family; /* Address family hostnames resolve to, AF_UNSPEC for either. */
+    bool   pmtu_discovery;
+    uint32_t pmtu_max;
+    uint32_t pmtu_min;
+    char *   parents; /* Comma separated labels from the `parent` option, lowercased, or NULL. */
+};
+
+/* Outcome of parse_echo_reply(). */
+enum reply_parse {
+    REPLY_SHORT,   /* Too short to hold an ICMP header. */
+    REPLY_FOREIGN, /* Something other than an echo reply. */
+    REPLY_ECHO
+};
+
+/* The fields of an echo reply which identify the probe answered. */
+struct echo_reply {
+    uint16_t              ident; /* Network byte order. */
+    uint16_t              seq;   /* Network byte order. */
+    const unsigned char * data;  /* Echo data following the ICMP header. */
+    size_t                data_bytes;
+};
+
+/* One struct per file descriptor registered with the event backend. */
+struct event_source {
+    int    fd;
+    void   (*handler)(void * context);
+    void * context;
+};
+
+/* A probe built by pinger(), waiting to be sent by send_batch_flush(). */
+struct send_slot {
+    const void *        packet;
+    size_t              bytes;
+    struct host_entry * host;
+    uint16_t            seq;
+    bool                dont_fragment;
+    bool                pmtu_probe;
+};
+
+/* Identifies the probe behind each transmit timestamp in the socket error queue. */
+struct tx_record {
+    struct host_entry * host;
+    uint16_t            seq;
+};
+
+/* The socket shared by all hosts of one address family. */
+struct probe_socket {
+    int              fd;
+    int              family;
+    bool             datagram;    /* Unprivileged SOCK_DGRAM socket rather than SOCK_RAW. */
+    bool             kernel_echo; /* The kernel sets the identifier and checksum of our echo requests. */
+    bool             ip_header;   /* Received packets begin with their IPv4 header. */
+    bool             dont_fragment; /* Current setting, toggled between runs of probes. */
+#if defined(SO_TIMESTAMPING)
+    /* Indexed by the per-socket counter the kernel attaches to each transmit timestamp. */
+    struct tx_record tx_ring[TX_RING_SIZE];
+    uint32_t         tx_next_key;
+#endif
+};
+
+/* An up/down command waiting for a free child slot. */
+struct command_job {
+    char *               command;
+    char **              extra_env; /* NULL-terminated "NAME=value" strings, or NULL. */
+    uint64_t             queued_at; /* Monotonic time the command was queued, for spawn latency. */
+    struct command_job * next;
+};
+
+/* A host state change waiting for the coalescing window to close. */
+struct transition {
+    char * name;
+    char * command;
+    bool   up;
+};
+
+/* A contiguous run of hosts owned by one shard. */
+struct host_range {
+    struct host_entry * hosts;
+    size_t              count;
+};
+
+/*
+ * A monitoring thread and the hosts it owns. Each shard has its own event
+ * loop, scheduler and sockets, so shards share nothing while pinging.
+ */
+struct shard {
+    /* Hosts owned by this shard: a slice of `host_table`, then any added by reloads. */
+    struct host_range *  ranges;
+    size_t               range_count;
+    size_t               host_count;  /* Not counting removed hosts. */
+    size_t               first_index; /* Position of the first range in `host_table`. */
+    /* ICMP identifiers are handed out from a fixed range, which the kernel filter checks. */
+    uint16_t             first_ident;
+    uint32_t             ident_span;
+    uint32_t             next_ident;
+    /* Hosts share one socket per address family. Replies are matched to hosts via this hash table. */
+    struct probe_socket  icmp4_socket;
+    struct probe_socket  icmp6_socket;
+    struct host_entry ** host_hash;
+    size_t               host_hash_mask;
+    /* Binary min-heap of pending timers, ordered by due time. */
+    struct timer **      timer_heap;
+    size_t               timer_count;
+    size_t               timer_capacity;
+    /* Probes queued while firing timers, sent together once all due timers have run. */
+    struct send_slot     send_batch[SEND_BATCH_SIZE];
+    int                  send_batch_count;
+#if defined(HAVE_MMSG)
+    struct mmsghdr       send_msgs[SEND_BATCH_SIZE];
+    struct iovec         send_iovs[SEND_BATCH_SIZE];
+    /* Preallocated ring of small buffers drained by each recvmmsg(). */
+    unsigned char        recv_buffers[RECV_BATCH_SIZE][ICMP_REPLY_BUFFER_BYTES];
+    union control_buffer recv_controls[RECV_BATCH_SIZE];
+    union host_addr      recv_addrs[RECV_BATCH_SIZE];
+    struct mmsghdr       recv_msgs[RECV_BATCH_SIZE];
+    struct iovec         recv_iovs[RECV_BATCH_SIZE];
+#endif
+    /* Event backend state. Descriptors are registered once and only ready ones are returned. */
+    struct event_source  event_sources[MAX_EVENT_SOURCES];
+    int                  event_source_count;
+#if defined(EVENT_BACKEND_EPOLL) || defined(EVENT_BACKEND_KQUEUE)
+    int                  event_fd;
+#else
+    struct pollfd        event_pollfds[MAX_EVENT_SOURCES];
+#endif
+    uint64_t             rate_limit_next; /* Earliest time the rate limiter allows the next ping. */
+    /* Lookups beyond this shard's share of `max_lookups` wait in the backlog. */
+    struct resolve_request * lookup_backlog_head;
+    struct resolve_request * lookup_backlog_tail;
+    int                      lookups_in_flight;
+    int                      lookup_limit;
+    /* Lookups finished by the resolver threads, protected by `resolver_lock`. */
+    struct resolve_request * resolver_done;
+    /* Wakes the event loop for finished lookups, statistics requests and reloads. */
+    int                      wake_pipe[2];
+    atomic_bool              stats_pending;
+    atomic_bool              park_pending;
+    /* Refreshes this shard's records in the state file. */
+    struct timer             state_timer;
+    /* Written on every packet, so kept off the cache lines of fields other threads touch. */
+    _Alignas(CACHE_LINE_BYTES) struct shard_metrics metrics;
+    struct event_ring        event_ring;
+};
+
+/* A host state change, passed from a shard to the executor on the main thread. */
+struct transition_event {
+    struct host_entry *       host;
+    bool                      up;
+    struct transition_event * next;
+};
+
+/* Globals */
+    /* Hosts in config file order, indexed alike. Cold configuration is kept apart from hot state. */
+    struct host_entry *  host_table        = NULL;
+    struct host_config * host_configs      = NULL;
+    size_t               total_hosts       = 0;
+    /* Config files given with -f, parsed again on SIGHUP. */
+    char **              config_files      = NULL;
+    int                  config_file_count = 0;
+    /* Hosts are partitioned among shards. Shard 0 runs on the main thread, alongside the executor. */
+    struct shard *                shards       = NULL;
+    int                           shard_count  = 1;
+    _Thread_local struct shard *  shard        = NULL; /* The shard owning the calling thread. */
+    /* Command executor. SIGCHLD is forwarded through a pipe to the main loop for reaping. */
+    struct command_job *  job_queue_head    = NULL;
+    struct command_job *  job_queue_tail    = NULL;
+    int                   queued_commands   = 0;
+    int                   running_children  = 0;
+    int                   child_pipe[2]     = { -1, -1 };
+    /* Host state changes collected during the current coalescing window. */
+    struct transition *   transitions       = NULL;
+    size_t                transition_count  = 0;
+    size_t                transition_capacity = 0;
+    struct timer          coalesce_timer;
+    /* Transitions from other shards, pushed without locking. Drained in order by the main thread. */
+    _Atomic(struct transition_event *) transition_inbox = NULL;
+    int                   transition_pipe[2] = { -1, -1 };
+    /* Hostname resolver pool, shared by all shards, protected by `resolver_lock`. */
+    pthread_mutex_t          resolver_lock       = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t           resolver_wakeup     = PTHREAD_COND_INITIALIZER;
+    struct resolve_request * resolver_queue_head = NULL;
+    struct resolve_request * resolver_queue_tail = NULL;
+    /* Set by command line flags. */
+    bool                verbose            = false;
+    bool                retry_down_cmd     = false; /* Default for the `retry_down_cmd` option. */
+    uint64_t            rate_limit_gap     = 0; /* Microseconds between pings, 0 for unlimited. */
+    bool                kernel_timestamps  = false;
+    bool                unprivileged       = false; /* Use datagram rather than raw ICMP sockets. */
+    int                 max_children       = DEFAULT_MAX_CHILDREN;
+    uint64_t            coalesce_window    = 0; /* Microseconds, 0 to run each command immediately. */
+    char *              batch_command      = NULL;
+    char *              metrics_destination = NULL;
+    int                 max_lookups        = DEFAULT_MAX_LOOKUPS;
+    uint64_t            lookup_timeout     = DEFAULT_LOOKUP_TIMEOUT;
+    /* Set from the SIGUSR1 handler, passed on to every shard by the main loop. */
+    volatile sig_atomic_t stats_requested  = 0;
+    /* Set from the SIGHUP handler, acted on by the main loop. */
+    volatile sig_atomic_t reload_requested = 0;
+    /* Set by SIGTERM or SIGINT when a state file is in use, so the main loop saves it before exiting. */
+    volatile sig_atomic_t exit_requested   = 0;
+    /* State file given with -p, mapped while running. Each shard writes only its own hosts' records. */
+    char *                state_file       = NULL;
+    struct state_header * state_map        = NULL;
+    size_t                state_map_bytes  = 0;
+    /* StatsD destination given with -m, flushed by a timer on the first shard. */
+    int                   metrics_fd       = -1;
+    struct timer          metrics_timer;
+    char                  metrics_packet[METRICS_PACKET_BYTES];
+    size_t                metrics_packet_len = 0;
+    uint64_t              metrics_reported[SHARD_METRIC_COUNT];     /* Totals as of the previous flush. */
+    uint64_t              metrics_reported_rtt[RTT_HISTOGRAM_BUCKETS];
+    /* Event log given with -e, written by its own thread. Hosts added by reloads are numbered from `next_host_number`. */
+    char *                event_log_path   = NULL;
+    int                   event_log_fd     = -1;
+    bool                  event_log_socket = false;
+    uint64_t              event_log_bytes  = 0;
+    uint32_t              next_host_number = 0;
+    /* Executor metrics, only touched by the main thread. */
+    uint64_t              commands_spawned    = 0;
+    uint64_t              commands_failed     = 0;
+    uint64_t              spawn_latency_total = 0; /* Microseconds, since the previous flush. */
+    uint64_t              spawn_latency_max   = 0;
+    uint64_t              spawn_latency_count = 0;
+    /* Other shards wait here, protected by `park_lock`, while the main thread reloads the config. */
+    pthread_mutex_t       park_lock        = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t        park_cond        = PTHREAD_COND_INITIALIZER;
+    int                   parked_shards    = 0;
+    bool                  world_stopped    = false;
+    /* Fastest checksum implementation this CPU supports, chosen by init_checksum(). */
+    uint64_t            (* checksum_sum)(const unsigned char *, size_t) = NULL;
+
+/*
+ * Return the one's complement sum of `len` bytes at `data`, unfolded.
+ *
+ * Data is summed as 32-bit words, in native byte order, into a 64-bit
+ * accumulator. Carries are left to checksum() to fold back in. RFC 1071
+ * shows this gives the same checksum as summing 16-bit words in network
+ * byte order.
+ */
+uint64_t
+checksum_sum_scalar(const unsigned char * data, size_t len)
+{
+    uint64_t accumulator = 0;
+    for (; len >= 4; data += 4, len -= 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        accumulator += word;
+    }
+    if (len >= 2) {
+        uint16_t word;
+        memcpy(&word, data, sizeof(word));
+        accumulator += word;
+        data += 2;
+        len -= 2;
+    }
+    /* An odd final byte is summed as if followed by a zero byte. */
+    if (len) {
+        uint16_t word = 0;
+        memcpy(&word, data, 1);
+        accumulator += word;
+    }
+    return accumulator;
+}
+
+#if defined(HAVE_CHECKSUM_AVX2)
+/*
+ * As checksum_sum_scalar(), widening 32 bytes at a time into four 64-bit lanes.
+ */
+__attribute__((target("avx2")))
+uint64_t
+checksum_sum_avx2(const unsigned char * data, size_t len)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i accumulator = zero;
+    size_t blocks = len / 32;
+    for (size_t i = 0; i < blocks; i++) {
+        __m256i words = _mm256_loadu_si256((const __m256i *) (data + 32 * i));
+        accumulator = _mm256_add_epi64(accumulator, _mm256_unpacklo_epi32(words, zero));
+        accumulator = _mm256_add_epi64(accumulator, _mm256_unpackhi_epi32(words, zero));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, accumulator);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + checksum_sum_scalar(data + 32 * blocks, len % 32);
+}
+#endif
+
+#if defined(HAVE_CHECKSUM_SSE2)
+/*
+ * As checksum_sum_scalar(), widening 16 bytes at a time into two 64-bit lanes.
+ */
+uint64_t
+checksum_sum_sse2(const unsigned char * data, size_t len)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i accumulator = zero;
+    size_t blocks = len / 16;
+    for (size_t i = 0; i < blocks; i++) {
+        __m128i words = _mm_loadu_si128((const __m128i *) (data + 16 * i));
+        accumulator = _mm_add_epi64(accumulator, _mm_unpacklo_epi32(words, zero));
+        accumulator = _mm_add_epi64(accumulator, _mm_unpackhi_epi32(words, zero));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, accumulator);
+    return lanes[0] + lanes[1] + checksum_sum_scalar(data + 16 * blocks, len % 16);
+}
+#endif
+
+#if defined(HAVE_CHECKSUM_NEON)
+/*
+ * As checksum_sum_scalar(), pairwise accumulating 16 bytes at a time into two 64-bit lanes.
+ */
+uint64_t
+checksum_sum_neon(const unsigned char * data, size_t len)
+{
+    uint64x2_t accumulator = vdupq_n_u64(0);
+    size_t blocks = len / 16;
+    for (size_t i = 0; i < blocks; i++) {
+        accumulator = vpadalq_u32(accumulator, vreinterpretq_u32_u8(vld1q_u8(data + 16 * i)));
+    }
+    return vgetq_lane_u64(accumulator, 0) + vgetq_lane_u64(accumulator, 1)
+           + checksum_sum_scalar(data + 16 * blocks, len % 16);
+}
+#endif
+
+/*
+ * Choose the fastest checksum implementation supported by this CPU.
+ */
+void
+init_checksum(void)
+{
+    checksum_sum = checksum_sum_scalar;
+#if defined(HAVE_CHECKSUM_SSE2)
+    checksum_sum = checksum_sum_sse2;
+#endif
+#if defined(HAVE_CHECKSUM_NEON)
+    checksum_sum = checksum_sum_neon;
+#endif
+#if defined(HAVE_CHECKSUM_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) checksum_sum = checksum_sum_avx2;
+#endif
+}
+
+/*
+ * Generate an Internet Checksum per RFC 1071 over `len` bytes at `data`. The
+ * result is in network byte order, ready to store in a packet.
+ */
+uint16_t
+checksum(const void * data, size_t len)
+{
+    uint64_t sum = checksum_sum(data, len);
+    while (sum > 0xffff) sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/*
+ * Return the checksum `sum` updated for `words` 16-bit words of the packet
+ * changing from `old` to `new`, without summing the rest of the packet again.
+ * This is eqn. 3 of RFC 1624: HC' = ~(~HC + ~m + m').
+ */
+uint16_t
+checksum_update(uint16_t sum, const uint16_t * old, const uint16_t * new, size_t words)
+{
+    uint32_t accumulator = (uint16_t) ~ntohs(sum);
+    for (size_t i = 0; i < words; i++) {
+        accumulator += (uint16_t) ~ntohs(old[i]);
+        accumulator += ntohs(new[i]);
+    }
+    while (accumulator > 0xffff) accumulator = (accumulator & 0xffff) + (accumulator >> 16);
+    return htons(~accumulator);
+}
+
+/*
+ * Return the current time in microseconds on the monotonic clock.
+ */
+uint64_t
+monotonic_usec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * USEC_PER_SEC + now.tv_nsec / 1000;
+}
+
+/*
+ * Return the current time in microseconds since the epoch on the wall clock.
+ */
+uint64_t
+realtime_usec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * USEC_PER_SEC + now.tv_nsec / 1000;
+}
+
+/*
+ * Return true if `ts` holds a timestamp rather than zero.
+ */
+bool
+timespec_isset(const struct timespec * ts)
+{
+    return ts->tv_sec || ts->tv_nsec;
+}
+
+/*
+ * Calculate the difference (a-b) in microseconds between two timespec structs.
+ */
+int64_t
+timespec_diff_usec(const struct timespec * a, const struct timespec * b)
+{
+    return (int64_t) (a->tv_sec - b->tv_sec) * USEC_PER_SEC + (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+/*
+ * Add one RTT sample to a host's statistics.
+ */
+void
+rtt_record(struct rtt_stats * stats, uint32_t rtt)
+{
+    if (stats->replies == 0 || rtt < stats->min) stats->min = rtt;
+    if (rtt > stats->max) stats->max = rtt;
+
+    if (stats->replies > 0) {
+        uint32_t delta = (rtt > stats->last) ? rtt - stats->last : stats->last - rtt;
+        stats->jitter += (delta - stats->jitter) / 16;
+    }
+    stats->last = rtt;
+
+    stats->replies++;
+    stats->total += rtt;
+
+    int bucket = 0;
+    while (bucket < RTT_HISTOGRAM_BUCKETS - 1 && (rtt >> (bucket + 1))) bucket++;
+    stats->histogram[bucket]++;
+}
+
+/*
+ * Add `n` to a metrics counter written only by the calling thread. Relaxed
+ * atomic accesses let the metrics flush read it from the main thread while
+ * still compiling to plain loads and stores.
+ */
+void
+counter_add(_Atomic uint64_t * counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/*
+ * Record an RTT, in microseconds, in the metrics of `host` and its shard.
+ */
+void
+metrics_record_rtt(struct host_entry * host, uint32_t rtt)
+{
+    counter_add(&host->metrics.counts[HOST_RTT_TOTAL], rtt);
+    counter_add(&host->metrics.counts[HOST_RTT_COUNT], 1);
+
+    int bucket = 0;
+    while (bucket < RTT_HISTOGRAM_BUCKETS - 1 && (rtt >> (bucket + 1))) bucket++;
+    counter_add(&shard->metrics.rtt_histogram[bucket], 1);
+}
+
+/*
+ * Queue an event log record about `host` for the writer thread, unless no
+ * event log is in use. Never blocks: with the ring full, the record is
+ * dropped and counted.
+ */
+void
+log_event(const struct host_entry * host, enum event_outcome outcome, uint16_t seq, int64_t rtt)
+{
+    if (event_log_path == NULL) return;
+
+    struct event_ring * ring = &shard->event_ring;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->cached_tail == EVENT_RING_RECORDS) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->cached_tail == EVENT_RING_RECORDS) {
+            counter_add(&shard->metrics.counts[SHARD_EVENTS_DROPPED], 1);
+            return;
+        }
+    }
+
+    struct event_record * record = &ring->records[head % EVENT_RING_RECORDS];
+    record->time    = realtime_usec();
+    record->host    = host->number;
+    record->rtt     = (rtt >= 0 && rtt < UINT32_MAX) ? rtt : UINT32_MAX;
+    record->seq     = seq;
+    record->outcome = outcome;
+    memset(record->reserved, 0, sizeof(record->reserved));
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * Set whether `host` is up, keeping its metrics in step.
+ */
+void
+set_host_up(struct host_entry * host, bool up)
+{
+    host->host_up = up;
+    atomic_store_explicit(&host->metrics.up, up, memory_order_relaxed);
+}
+
+/*
+ * Print RTT statistics for every host in this shard. Triggered by SIGUSR1.
+ */
+void
+print_stats(void)
+{
+    for (size_t r = 0; r < shard->range_count; r++) {
+        struct host_entry * host = shard->ranges[r].hosts;
+        for (size_t i = 0; i < shard->ranges[r].count; i++, host++) {
+            if (host->removed) continue;
+            struct rtt_stats * stats = &host->rtt;
+            if (stats->replies == 0) {
+                printf("STATS: %s no replies\n", host->config->name);
+                continue;
+            }
+            printf("STATS: %s %llu replies, rtt min/avg/max/jitter = %.3f/%.3f/%.3f/%.3f ms, histogram",
+                   host->config->name, (unsigned long long) stats->replies,
+                   stats->min / 1000.0, (double) stats->total / stats->replies / 1000.0,
+                   stats->max / 1000.0, stats->jitter / 1000.0);
+            for (int i = 0; i < RTT_HISTOGRAM_BUCKETS; i++) {
+                if (stats->histogram[i]) printf(" <%luus:%u", 2UL << i, stats->histogram[i]);
+            }
+            if (host->path_mtu) printf(", path MTU %u", host->path_mtu);
+            printf("\n");
+        }
+    }
+    fflush(stdout);
+}
+
+void
+request_stats(int ignore) /* Dummy parameter since this function registers as a signal handler. */
+{
+    stats_requested = 1;
+}
+
+void
+request_reload(int ignore) /* Dummy parameter since this function registers as a signal handler. */
+{
+    reload_requested = 1;
+}
+
+void
+request_exit(int ignore) /* Dummy parameter since this function registers as a signal handler. */
+{
+    exit_requested = 1;
+}
+
+/*
+ * Create the event backend. Must be called before event_register().
+ */
+void
+event_init(void)
+{
+#if defined(EVENT_BACKEND_EPOLL)
+    shard->event_fd = epoll_create1(EPOLL_CLOEXEC);
+#elif defined(EVENT_BACKEND_KQUEUE)
+    shard->event_fd = kqueue();
+#endif
+#if defined(EVENT_BACKEND_EPOLL) || defined(EVENT_BACKEND_KQUEUE)
+    if (shard->event_fd < 0) {
+        fprintf(stderr, "ERROR: Unable to create event backend.\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+}
+
+/*
+ * Register `handler` to be called with `context` whenever `fd` is readable.
+ */
+void
+event_register(int fd, void (*handler)(void * context), void * context)
+{
+    if (shard->event_source_count >= MAX_EVENT_SOURCES) {
+        fprintf(stderr, "ERROR: Too many event sources. Increase MAX_EVENT_SOURCES.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct event_source * source = &shard->event_sources[shard->event_source_count];
+    source->fd      = fd;
+    source->handler = handler;
+    source->context = context;
+
+    int retval = 0;
+#if defined(EVENT_BACKEND_EPOLL)
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = source;
+    retval = epoll_ctl(shard->event_fd, EPOLL_CTL_ADD, fd, &ev);
+#elif defined(EVENT_BACKEND_KQUEUE)
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, source);
+    retval = kevent(shard->event_fd, &ev, 1, NULL, 0, NULL);
+#else
+    shard->event_pollfds[shard->event_source_count].fd     = fd;
+    shard->event_pollfds[shard->event_source_count].events = POLLIN;
+#endif
+    if (retval < 0) {
+        fprintf(stderr, "ERROR: Unable to register descriptor %d with event backend.\n", fd);
+        exit(EXIT_FAILURE);
+    }
+
+    shard->event_source_count++;
+}
+
+/*
+ * Wait up to `timeout_ms` milliseconds (forever if negative) for registered
+ * descriptors to become readable, then call the handler for each ready one.
+ */
+void
+event_dispatch(int timeout_ms)
+{
+#if defined(EVENT_BACKEND_EPOLL)
+    struct epoll_event events[EVENT_BATCH_SIZE];
+    int ready = epoll_wait(shard->event_fd, events, EVENT_BATCH_SIZE, timeout_ms);
+    for (int i = 0; i < ready; i++) {
+        struct event_source * source = events[i].data.ptr;
+        source->handler(source->context);
+    }
+#elif defined(EVENT_BACKEND_KQUEUE)
+    struct kevent events[EVENT_BATCH_SIZE];
+    struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+    int ready = kevent(shard->event_fd, NULL, 0, events, EVENT_BATCH_SIZE, (timeout_ms < 0) ? NULL : &timeout);
+    for (int i = 0; i < ready; i++) {
+        struct event_source * source = events[i].udata;
+        source->handler(source->context);
+    }
+#else
+    int ready = poll(shard->event_pollfds, shard->event_source_count, timeout_ms);
+    for (int i = 0; i < shard->event_source_count && ready > 0; i++) {
+        if (shard->event_pollfds[i].revents) {
+            shard->event_sources[i].handler(shard->event_sources[i].context);
+            ready--;
+        }
+    }
+#endif
+    /* On error or interruption there is nothing useful to do. The caller simply waits again. */
+}
+
+/*
+ * Swap two entries in the timer heap, keeping their back-references in sync.
+ */
+void
+timer_heap_swap(size_t a, size_t b)
+{
+    struct timer * temp = shard->timer_heap[a];
+    shard->timer_heap[a] = shard->timer_heap[b];
+    shard->timer_heap[b] = temp;
+    shard->timer_heap[a]->heap_index = a;
+    shard->timer_heap[b]->heap_index = b;
+}
+
+/*
+ * Restore the heap property for the entry at `index` after its due time changed.
+ */
+void
+timer_heap_fix(size_t index)
+{
+    while (index > 0 && shard->timer_heap[(index-1)/2]->due > shard->timer_heap[index]->due) {
+        timer_heap_swap(index, (index-1)/2);
+        index = (index-1)/2;
+    }
+    while (true) {
+        size_t smallest = index;
+        size_t left = 2*index + 1;
+        size_t right = 2*index + 2;
+        if (left < shard->timer_count && shard->timer_heap[left]->due < shard->timer_heap[smallest]->due) smallest = left;
+        if (right < shard->timer_count && shard->timer_heap[right]->due < shard->timer_heap[smallest]->due) smallest = right;
+        if (smallest == index) break;
+        timer_heap_swap(index, smallest);
+        index = smallest;
+    }
+}
+
+/*
+ * Prepare a timer for use. The timer starts out inactive.
+ */
+void
+timer_init(struct timer * timer, void (*callback)(void * context), void * context)
+{
+    timer->due        = 0;
+    timer->heap_index = TIMER_INACTIVE;
+    timer->callback   = callback;
+    timer->context    = context;
+}
+
+/*
+ * Arrange for a timer to fire at time `due`, rescheduling it if already pending.
+ */
+void
+timer_schedule(struct timer * timer, uint64_t due)
+{
+    timer->due = due;
+    if (timer->heap_index == TIMER_INACTIVE) {
+        if (shard->timer_count == shard->timer_capacity) {
+            shard->timer_capacity = shard->timer_capacity ? shard->timer_capacity * 2 : 64;
+            if ((shard->timer_heap = realloc(shard->timer_heap, shard->timer_capacity * sizeof(*shard->timer_heap))) == NULL) {
+                fprintf(stderr, "ERROR: Unable to grow timer heap.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        timer->heap_index = shard->timer_count;
+        shard->timer_heap[shard->timer_count++] = timer;
+    }
+    timer_heap_fix(timer->heap_index);
+}
+
+/*
+ * Remove a timer from the scheduler. Nothing is done if it isn't pending.
+ */
+void
+timer_cancel(struct timer * timer)
+{
+    size_t index = timer->heap_index;
+    if (index == TIMER_INACTIVE) return;
+
+    timer->heap_index = TIMER_INACTIVE;
+    if (index != --shard->timer_count) {
+        shard->timer_heap[index] = shard->timer_heap[shard->timer_count];
+        shard->timer_heap[index]->heap_index = index;
+        timer_heap_fix(index);
+    }
+}
+
+/*
+ * Fire every timer due at or before `now`. Callbacks may reschedule their own timer.
+ */
+void
+timer_run_expired(uint64_t now)
+{
+    while (shard->timer_count > 0 && shard->timer_heap[0]->due <= now) {
+        struct timer * timer = shard->timer_heap[0];
+        timer_cancel(timer);
+        timer->callback(timer->context);
+    }
+}
+
+/*
+ * Return the number of milliseconds until the next timer is due, suitable as
+ * an event_dispatch() timeout. Returns -1 if no timers are pending.
+ */
+int
+timer_timeout_ms(uint64_t now)
+{
+    if (shard->timer_count == 0) return -1;
+    if (shard->timer_heap[0]->due <= now) return 0;
+    uint64_t wait = (shard->timer_heap[0]->due - now + USEC_PER_MSEC - 1) / USEC_PER_MSEC;
+    return (wait > INT_MAX) ? INT_MAX : (int) wait;
+}
+
+/*
+ * Return the key under which the state of the host configured by `config` is
+ * saved: an FNV-1a hash of its section label and hostname, so a host pointed
+ * at a different name starts afresh.
+ */
+uint64_t
+state_key(const struct host_config * config)
+{
+    const char * parts[] = { config->label, config->name };
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 2; i++) {
+        const char * p = parts[i];
+        do hash = (hash ^ (unsigned char) *p) * 0x100000001b3ULL; while (*p++);
+    }
+    return hash;
+}
+
+/*
+ * Write the current state of `host` into its record in the state file, if it
+ * has one. Must be called from the owning shard.
+ */
+void
+save_host_state(const struct host_entry * host, uint64_t now, uint64_t wall)
+{
+    struct state_record * record = host->state_record;
+    if (record == NULL) return;
+    record->key        = state_key(host->config);
+    record->known      = !host->state_unknown;
+    record->host_up    = host->host_up;
+    record->last_reply = host->last_ping_received ? wall - (now - host->last_ping_received) : 0;
+}
+
+/*
+ * Refresh the state file records of this shard's hosts. Runs every
+ * STATE_SAVE_INTERVAL from each shard's own loop.
+ */
+void
+save_shard_state(void * ignore) /* Dummy parameter since this function registers as a timer callback. */
+{
+    uint64_t now = monotonic_usec(), wall = realtime_usec();
+    for (size_t r = 0; r < shard->range_count; r++) {
+        struct host_entry * host = shard->ranges[r].hosts;
+        for (size_t i = 0; i < shard->ranges[r].count; i++, host++) {
+            if (!host->removed) save_host_state(host, now, wall);
+        }
+    }
+    timer_schedule(&shard->state_timer, now + STATE_SAVE_INTERVAL);
+}
+
+/*
+ * Compare state records by key, for qsort() and bsearch().
+ */
+int
+compare_state_records(const void * a, const void * b)
+{
+    uint64_t key_a = ((const struct state_record *) a)->key;
+    uint64_t key_b = ((const struct state_record *) b)->key;
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+/*
+ * Give hosts starting in `auto` the state saved in the state file by the
+ * previous run, along with the time of their last reply. Hosts missing from
+ * the file are left for the startup sweep to settle. Must run before any host
+ * is scheduled.
+ */
+void
+restore_state(void)
+{
+    int fd = open(state_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) fprintf(stderr, "WARN: Unable to open state file %s. Starting afresh.\n", state_file);
+        return;
+    }
+
+    struct stat st;
+    struct state_header * header = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(struct state_header)) {
+        header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (header == MAP_FAILED || header->magic != STATE_FILE_MAGIC || header->version != STATE_FILE_VERSION
+        || header->record_count > (st.st_size - sizeof(struct state_header)) / sizeof(struct state_record)) {
+        fprintf(stderr, "WARN: Ignoring unrecognized state file %s.\n", state_file);
+        if (header != MAP_FAILED) munmap(header, st.st_size);
+        return;
+    }
+
+    /* Records are sorted by key so each host finds its own with a binary search. */
+    size_t count = header->record_count;
+    struct state_record * records = malloc((count ? count : 1) * sizeof(struct state_record));
+    if (records == NULL) {
+        fprintf(stderr, "WARN: Unable to allocate memory for state file %s. Starting afresh.\n", state_file);
+        munmap(header, st.st_size);
+        return;
+    }
+    memcpy(records, header + 1, count * sizeof(struct state_record));
+    munmap(header, st.st_size);
+    qsort(records, count, sizeof(struct state_record), compare_state_records);
+
+    /* Saved wall clock times are carried over to the monotonic clock. */
+    uint64_t now = monotonic_usec(), wall = realtime_usec();
+    size_t restored = 0;
+    for (size_t i = 0; i < total_hosts; i++) {
+        struct host_entry * host = &host_table[i];
+        if (!host->state_unknown) continue;
+        struct state_record wanted = { .key = state_key(&host_configs[i]) };
+        const struct state_record * record = bsearch(&wanted, records, count, sizeof(struct state_record), compare_state_records);
+        if (record == NULL || !record->known) continue;
+
+        host->state_unknown = false;
+        host->host_up = record->host_up;
+        uint64_t age = (record->last_reply && record->last_reply <= wall) ? wall - record->last_reply : UINT64_MAX;
+        host->last_ping_received = (age < now) ? now - age : 0;
+        restored++;
+    }
+    free(records);
+
+    if (verbose) printf("INFO: Restored the state of %zu hosts from %s.\n", restored, state_file);
+}
+
+/*
+ * (Re)create the state file with a record for every host being monitored,
+ * filled in with their current state. Called at startup and, with the other
+ * shards stopped, after each reload.
+ */
+void
+map_state_file(void)
+{
+    if (state_map) munmap(state_map, state_map_bytes);
+    state_map = NULL;
+
+    size_t live = 0;
+    for (int i = 0; i < shard_count; i++) live += shards[i].host_count;
+    size_t bytes = sizeof(struct state_header) + live * sizeof(struct state_record);
+
+    void * map = MAP_FAILED;
+    int fd = open(state_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0 && ftruncate(fd, bytes) == 0) map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0) close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "WARN: Unable to map state file %s. Host states will not be saved.\n", state_file);
+    } else {
+        state_map = map;
+        state_map_bytes = bytes;
+        state_map->magic = STATE_FILE_MAGIC;
+        state_map->version = STATE_FILE_VERSION;
+        state_map->record_count = live;
+    }
+
+    struct state_record * record = state_map ? (struct state_record *) (state_map + 1) : NULL;
+    uint64_t now = monotonic_usec(), wall = realtime_usec();
+    for (int i = 0; i < shard_count; i++) {
+        struct shard * s = &shards[i];
+        for (size_t r = 0; r < s->range_count; r++) {
+            struct host_entry * host = s->ranges[r].hosts;
+            for (size_t k = 0; k < s->ranges[r].count; k++, host++) {
+                host->state_record = (record && !host->removed) ? record++ : NULL;
+                save_host_state(host, now, wall);
+            }
+        }
+    }
+}
+
+/*
+ * Start saving host states to the state file, each shard refreshing its own
+ * hosts' records from its loop. Must be called before the shards start.
+ */
+void
+init_state(void)
+{
+    map_state_file();
+    uint64_t now = monotonic_usec();
+    for (int i = 0; i < shard_count; i++) {
+        shard = &shards[i];
+        timer_init(&shard->state_timer, save_shard_state, NULL);
+        timer_schedule(&shard->state_timer, now + STATE_SAVE_INTERVAL);
+    }
+    shard = &shards[0];
+}
+
+/*
+ * Start `command` without waiting for it to finish. Simple commands are
+ * executed directly, anything needing the shell via `/bin/sh -c`. Any
+ * `extra_env` strings are added to the command's environment.
+ *
+ * Returns false if the command could not be started.
+ */
+bool
+spawn_command(const char * command, char ** extra_env)
+{
+    extern char ** environ;
+
+    char ** envp = environ;
+    if (extra_env) {
+        size_t extra_count = 0, environ_count = 0;
+        while (extra_env[extra_count]) extra_count++;
+        while (environ[environ_count]) environ_count++;
+        if ((envp = malloc((extra_count + environ_count + 1) * sizeof(*envp))) == NULL) {
+            fprintf(stderr, "WARN: Unable to build environment for command: %s\n", command);
+            return false;
+        }
+        memcpy(envp, extra_env, extra_count * sizeof(*envp));
+        memcpy(envp + extra_count, environ, (environ_count + 1) * sizeof(*envp));
+    }
+
+    char * argv[MAX_DIRECT_ARGS + 1];
+    char * words = NULL;
+    int argc = 0;
+    if (strpbrk(command, SHELL_METACHARACTERS) == NULL && (words = strdup(command))) {
+        for (char * word = strtok(words, " \t"); word && argc <= MAX_DIRECT_ARGS; word = strtok(NULL, " \t")) {
+            argv[argc++] = word;
+        }
+    }
+
+    pid_t pid;
+    int retval;
+    if (argc > 0 && argc <= MAX_DIRECT_ARGS) {
+        argv[argc] = NULL;
+        retval = posix_spawnp(&pid, argv[0], NULL, NULL, argv, envp);
+    } else {
+        char * shell_argv[] = { "/bin/sh", "-c", (char *) command, NULL };
+        retval = posix_spawn(&pid, "/bin/sh", NULL, NULL, shell_argv, envp);
+    }
+    free(words);
+    if (envp != environ) free(envp);
+
+    if (retval != 0) {
+        fprintf(stderr, "WARN: Unable to execute command: %s\n", command);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Start queued commands until the queue is empty or `max_children` are running.
+ */
+void
+start_queued_commands(void)
+{
+    while (job_queue_head && running_children < max_children) {
+        struct command_job * job = job_queue_head;
+        job_queue_head = job->next;
+        if (job_queue_head == NULL) job_queue_tail = NULL;
+        queued_commands--;
+
+        if (spawn_command(job->command, job->extra_env)) {
+            running_children++;
+            commands_spawned++;
+            uint64_t latency = monotonic_usec() - job->queued_at;
+            spawn_latency_total += latency;
+            spawn_latency_count++;
+            if (latency > spawn_latency_max) spawn_latency_max = latency;
+        } else {
+            commands_failed++;
+        }
+        free(job->command);
+        for (char ** var = job->extra_env; var && *var; var++) free(*var);
+        free(job->extra_env);
+        free(job);
+    }
+}
+
+/*
+ * Queue a command for execution, starting it at once if a child slot is free.
+ * Takes ownership of `extra_env`, which may be NULL.
+ */
+void
+run_command(const char * command, char ** extra_env)
+{
+    struct command_job * job = NULL;
+    if (queued_commands >= MAX_QUEUED_COMMANDS) {
+        fprintf(stderr, "WARN: Command queue full. Dropping command: %s\n", command);
+    } else if ((job = malloc(sizeof(struct command_job))) == NULL || (job->command = strdup(command)) == NULL) {
+        fprintf(stderr, "WARN: Unable to queue command: %s\n", command);
+        free(job);
+        job = NULL;
+    }
+    if (job == NULL) {
+        for (char ** var = extra_env; var && *var; var++) free(*var);
+        free(extra_env);
+        return;
+    }
+    job->extra_env = extra_env;
+    job->queued_at = monotonic_usec();
+    job->next = NULL;
+
+    if (job_queue_tail) {
+        job_queue_tail->next = job;
+    } else {
+        job_queue_head = job;
+    }
+    job_queue_tail = job;
+    queued_commands++;
+
+    start_queued_commands();
+}
+
+/*
+ * Build a "NAME=host host ..." environment string from the coalesced
+ * transitions in direction `up`.
+ */
+char *
+batch_env_var(const char * prefix, bool up)
+{
+    size_t len = strlen(prefix) + 1;
+    for (size_t i = 0; i < transition_count; i++) {
+        if (transitions[i].up == up) len += strlen(transitions[i].name) + 1;
+    }
+
+    char * var = malloc(len);
+    if (var == NULL) return NULL;
+    strcpy(var, prefix);
+    bool first = true;
+    for (size_t i = 0; i < transition_count; i++) {
+        if (transitions[i].up != up) continue;
+        if (!first) strcat(var, " ");
+        strcat(var, transitions[i].name);
+        first = false;
+    }
+    return var;
+}
+
+/*
+ * Called by the scheduler when the coalescing window closes. A lone
+ * transition runs its host's own command. Otherwise the `-b` batch command
+ * runs once, with the affected hosts listed in its environment.
+ */
+void
+flush_transitions(void * ignore) /* Dummy parameter since this function registers as a timer callback. */
+{
+    if (transition_count == 1) {
+        run_command(transitions[0].command, NULL);
+    } else if (transition_count > 1) {
+        if (verbose) printf("INFO: Executing batch command for %zu host transitions.\n", transition_count);
+        char ** extra_env = calloc(3, sizeof(*extra_env));
+        if (extra_env) {
+            extra_env[0] = batch_env_var(BATCH_ENV_UP, true);
+            extra_env[1] = batch_env_var(BATCH_ENV_DOWN, false);
+        }
+        if (extra_env == NULL || extra_env[0] == NULL || extra_env[1] == NULL) {
+            fprintf(stderr, "WARN: Unable to build host list for batch command.\n");
+            if (extra_env) free(extra_env[0]);
+            free(extra_env);
+        } else {
+            run_command(batch_command, extra_env);
+        }
+    }
+
+    for (size_t i = 0; i < transition_count; i++) {
+        free(transitions[i].name);
+        free(transitions[i].command);
+    }
+    transition_count = 0;
+}
+
+/*
+ * Execute the up or down command for a host which just changed state. With
+ * `-c` and `-b`, the command is instead held until the coalescing window
+ * closes so that simultaneous transitions can share one batch command.
+ * Runs on the main thread.
+ */
+void
+execute_transition(struct host_entry * host, bool up)
+{
+    const char * command = up ? host->config->up_cmd : host->config->down_cmd;
+    if (coalesce_window == 0 || batch_command == NULL) {
+        run_command(command, NULL);
+        return;
+    }
+
+    if (transition_count == transition_capacity) {
+        size_t capacity = transition_capacity ? transition_capacity * 2 : 64;
+        struct transition * grown = realloc(transitions, capacity * sizeof(*transitions));
+        if (grown == NULL) {
+            fprintf(stderr, "WARN: Unable to coalesce transition for %s. Running its command now.\n", host->config->name);
+            run_command(command, NULL);
+            return;
+        }
+        transitions = grown;
+        transition_capacity = capacity;
+    }
+
+    char * name = strdup(host->config->name);
+    char * copy = strdup(command);
+    if (name == NULL || copy == NULL) {
+        fprintf(stderr, "WARN: Unable to coalesce transition for %s. Running its command now.\n", host->config->name);
+        free(name);
+        free(copy);
+        run_command(command, NULL);
+        return;
+    }
+
+    struct transition * transition = &transitions[transition_count++];
+    transition->name    = name;
+    transition->command = copy;
+    transition->up      = up;
+
+    if (coalesce_timer.heap_index == TIMER_INACTIVE) {
+        timer_schedule(&coalesce_timer, monotonic_usec() + coalesce_window);
+    }
+}
+
+/*
+ * Pass a host state change to the executor. Shards on other threads push it
+ * onto `transition_inbox` without locking, waking the main thread only when
+ * the inbox was empty.
+ */
+void
+report_transition(struct host_entry * host, bool up)
+{
+    log_event(host, up ? EVENT_UP : EVENT_DOWN, host->seq - 1, -1);
+    if (shard == &shards[0]) {
+        execute_transition(host, up);
+        return;
+    }
+
+    struct transition_event * event = malloc(sizeof(struct transition_event));
+    if (event == NULL) {
+        fprintf(stderr, "WARN: Unable to report transition of %s to executor.\n", host->config->name);
+        return;
+    }
+    event->host = host;
+    event->up   = up;
+    event->next = atomic_load(&transition_inbox);
+    while (!atomic_compare_exchange_weak(&transition_inbox, &event->next, event));
+
+    if (event->next == NULL && write(transition_pipe[1], "", 1) < 0) {
+        /* The pipe is full, so the main loop already has a wakeup pending. */
+    }
+}
+
+/*
+ * Execute the transitions pushed by other shards, oldest first.
+ */
+void
+read_transitions(void * ignore) /* Dummy parameter since this function registers as an event handler. */
+{
+    char buf[64];
+    while (read(transition_pipe[0], buf, sizeof(buf)) > 0);
+
+    /* The inbox is a stack, so reverse it to restore arrival order. */
+    struct transition_event * event = atomic_exchange(&transition_inbox, NULL);
+    struct transition_event * ordered = NULL;
+    while (event) {
+        struct transition_event * next = event->next;
+        event->next = ordered;
+        ordered = event;
+        event = next;
+    }
+
+    while (ordered) {
+        struct transition_event * next = ordered->next;
+        execute_transition(ordered->host, ordered->up);
+        free(ordered);
+        ordered = next;
+    }
+}
+
+void
+child_exited(int ignore) /* Dummy parameter since this function registers as a signal handler. */
+{
+    int saved_errno = errno;
+    if (write(child_pipe[1], "", 1) < 0) {
+        /* The pipe is full, so the main loop already has a wakeup pending. */
+    }
+    errno = saved_errno;
+}
+
+/*
+ * Reap finished commands and start any waiting for a free child slot.
+ */
+void
+reap_children(void * ignore) /* Dummy parameter since this function registers as an event handler. */
+{
+    char buf[64];
+    while (read(child_pipe[0], buf, sizeof(buf)) > 0);
+
+    int status;
+    while (waitpid(-1, &status, WNOHANG) > 0) running_children--;
+
+    start_queued_commands();
+}
+
+/*
+ * Set a descriptor to be non-blocking and closed across exec.
+ */
+void
+set_fd_flags(int fd, bool nonblocking)
+{
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+    if (nonblocking) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/*
+ * Create the pipes through which SIGCHLD and other shards wake the main loop,
+ * and register them. Must be called on the main thread after event_init().
+ */
+void
+init_executor(void)
+{
+    if (pipe(child_pipe) < 0 || pipe(transition_pipe) < 0) {
+        fprintf(stderr, "ERROR: Unable to create pipe for command executor.\n");
+        exit(EXIT_FAILURE);
+    }
+    set_fd_flags(child_pipe[0], true);
+    set_fd_flags(child_pipe[1], true);
+    set_fd_flags(transition_pipe[0], true);
+    set_fd_flags(transition_pipe[1], true);
+
+    event_register(child_pipe[0], reap_children, NULL);
+    event_register(transition_pipe[0], read_transitions, NULL);
+    signal(SIGCHLD, child_exited);
+
+    timer_init(&coalesce_timer, flush_transitions, NULL);
+}
+
+/*
+ * Send the StatsD lines collected so far, if any. A datagram the socket
+ * buffer has no room for is dropped rather than delaying monitoring.
+ */
+void
+metrics_send(void)
+{
+    if (metrics_packet_len == 0) return;
+    if (send(metrics_fd, metrics_packet, metrics_packet_len, MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        if (verbose) printf("INFO: Unable to send metrics.\n");
+    }
+    metrics_packet_len = 0;
+}
+
+/*
+ * Append one StatsD line, prefixed with METRICS_PREFIX, to the datagram being
+ * built, sending it first if the line won't fit.
+ */
+void
+metrics_line(const char * format, ...)
+{
+    char line[METRICS_PACKET_BYTES];
+    size_t len = strlen(METRICS_PREFIX);
+    memcpy(line, METRICS_PREFIX, len);
+
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(line + len, sizeof(line) - len - 1, format, args);
+    va_end(args);
+    if (written < 0 || len + written >= sizeof(line) - 1) return;
+    len += written;
+    line[len++] = '\n';
+
+    if (metrics_packet_len + len > METRICS_PACKET_BYTES) metrics_send();
+    memcpy(metrics_packet + metrics_packet_len, line, len);
+    metrics_packet_len += len;
+}
+
+/*
+ * Copy `label` into `buf` as one component of a StatsD metric name, replacing
+ * anything but letters, digits, '-' and '_'.
+ */
+const char *
+metrics_name(const char * label, char * buf, size_t len)
+{
+    size_t i = 0;
+    for (; label[i] && i < len - 1; i++) {
+        unsigned char c = label[i];
+        bool plain = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+        buf[i] = plain ? c : '_';
+    }
+    buf[i] = '\0';
+    return buf;
+}
+
+/*
+ * Return how much the counter at `counter` grew since `*reported`, updating
+ * `*reported`.
+ */
+uint64_t
+metrics_delta(_Atomic uint64_t * counter, uint64_t * reported)
+{
+    uint64_t total = atomic_load_explicit(counter, memory_order_relaxed);
+    uint64_t delta = total - *reported;
+    *reported = total;
+    return delta;
+}
+
+/*
+ * Push the counters of every shard and host, and of the executor, as StatsD
+ * lines. Counters are sent as increments since the previous flush, so a lost
+ * datagram only loses one interval. Runs every METRICS_INTERVAL on the main
+ * thread.
+ */
+void
+flush_metrics(void * ignore) /* Dummy parameter since this function registers as a timer callback. */
+{
+    static const char * const shard_metric_names[SHARD_METRIC_COUNT] = {
+        "probes_sent", "send_errors", "replies", "timeouts", "short_packets", "foreign_packets", "events_dropped"
+    };
+    static const char * const host_metric_names[] = { "probes_sent", "replies", "timeouts" };
+
+    uint64_t totals[SHARD_METRIC_COUNT] = { 0 };
+    uint64_t rtt_totals[RTT_HISTOGRAM_BUCKETS] = { 0 };
+    size_t hosts_up = 0, hosts_down = 0, hosts_unreachable = 0;
+    for (int i = 0; i < shard_count; i++) {
+        struct shard * s = &shards[i];
+        for (int m = 0; m < SHARD_METRIC_COUNT; m++) {
+            totals[m] += atomic_load_explicit(&s->metrics.counts[m], memory_order_relaxed);
+        }
+        for (int b = 0; b < RTT_HISTOGRAM_BUCKETS; b++) {
+            rtt_totals[b] += atomic_load_explicit(&s->metrics.rtt_histogram[b], memory_order_relaxed);
+        }
+
+        for (size_t r = 0; r < s->range_count; r++) {
+            struct host_entry * host = s->ranges[r].hosts;
+            for (size_t k = 0; k < s->ranges[r].count; k++, host++) {
+                if (host->removed) continue;
+                struct host_metrics * metrics = &host->metrics;
+                char name[128];
+                metrics_name(host->config->label, name, sizeof(name));
+
+                for (int m = 0; m < HOST_RTT_TOTAL; m++) {
+                    uint64_t delta = metrics_delta(&metrics->counts[m], &metrics->reported[m]);
+                    if (delta) metrics_line("host.%s.%s:%llu|c", name, host_metric_names[m], (unsigned long long) delta);
+                }
+                uint64_t rtt_total = metrics_delta(&metrics->counts[HOST_RTT_TOTAL], &metrics->reported[HOST_RTT_TOTAL]);
+                uint64_t rtt_count = metrics_delta(&metrics->counts[HOST_RTT_COUNT], &metrics->reported[HOST_RTT_COUNT]);
+                if (rtt_count) metrics_line("host.%s.rtt_avg_ms:%.3f|g", name, (double) rtt_total / rtt_count / USEC_PER_MSEC);
+
+                bool up = atomic_load_explicit(&metrics->up, memory_order_relaxed);
+                metrics_line("host.%s.up:%d|g", name, up);
+                if (up) hosts_up++; else hosts_down++;
+                if (atomic_load_explicit(&host->unreachable, memory_order_relaxed)) hosts_unreachable++;
+            }
+        }
+    }
+
+    for (int m = 0; m < SHARD_METRIC_COUNT; m++) {
+        metrics_line("%s:%llu|c", shard_metric_names[m], (unsigned long long) (totals[m] - metrics_reported[m]));
+        metrics_reported[m] = totals[m];
+    }
+    for (int b = 0; b < RTT_HISTOGRAM_BUCKETS; b++) {
+        uint64_t delta = rtt_totals[b] - metrics_reported_rtt[b];
+        if (delta) metrics_line("rtt.lt_%luus:%llu|c", 2UL << b, (unsigned long long) delta);
+        metrics_reported_rtt[b] = rtt_totals[b];
+    }
+    metrics_line("hosts.up:%zu|g", hosts_up);
+    metrics_line("hosts.down:%zu|g", hosts_down);
+    metrics_line("hosts.unreachable:%zu|g", hosts_unreachable);
+
+    metrics_line("commands.spawned:%llu|c", (unsigned long long) commands_spawned);
+    metrics_line("commands.failed:%llu|c", (unsigned long long) commands_failed);
+    metrics_line("commands.queued:%d|g", queued_commands);
+    if (spawn_latency_count) {
+        metrics_line("commands.spawn_latency_avg_ms:%.3f|g", (double) spawn_latency_total / spawn_latency_count / USEC_PER_MSEC);
+        metrics_line("commands.spawn_latency_max_ms:%.3f|g", (double) spawn_latency_max / USEC_PER_MSEC);
+    }
+    commands_spawned = commands_failed = 0;
+    spawn_latency_total = spawn_latency_max = spawn_latency_count = 0;
+
+    metrics_send();
+    timer_schedule(&metrics_timer, monotonic_usec() + METRICS_INTERVAL);
+}
+
+/*
+ * Open the StatsD socket to `destination`, given as "host:port", and start
+ * flushing metrics from the main thread's loop.
+ */
+void
+init_metrics(const char * destination)
+{
+    char * host = strdup(destination);
+    char * port = host ? strrchr(host, ':') : NULL;
+    if (port == NULL) {
+        fprintf(stderr, "ERROR: Metrics destination %s is not of the form host:port.\n", destination);
+        exit(EXIT_FAILURE);
+    }
+    *port++ = '\0';
+    /* IPv6 addresses may be bracketed, as in [::1]:8125. */
+    char * name = host;
+    if (name[0] == '[' && name[strlen(name) - 1] == ']') {
+        name[strlen(name) - 1] = '\0';
+        name++;
+    }
+
+    struct addrinfo hints, * result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(name, port, &hints, &result) != 0) {
+        fprintf(stderr, "ERROR: Unable to resolve metrics destination %s.\n", destination);
+        exit(EXIT_FAILURE);
+    }
+    metrics_fd = socket(result->ai_family, SOCK_DGRAM, 0);
+    if (metrics_fd < 0 || connect(metrics_fd, result->ai_addr, result->ai_addrlen) < 0) {
+        fprintf(stderr, "ERROR: Unable to open metrics socket to %s.\n", destination);
+        exit(EXIT_FAILURE);
+    }
+    set_fd_flags(metrics_fd, true);
+    freeaddrinfo(result);
+    free(host);
+
+    timer_init(&metrics_timer, flush_metrics, NULL);
+    timer_schedule(&metrics_timer, monotonic_usec() + METRICS_INTERVAL);
+}
+
+/*
+ * Write `bytes` at `data` to the event log. On failure the log is closed.
+ *
+ * Returns false if the data couldn't all be written.
+ */
+bool
+write_event_log(const void * data, size_t bytes)
+{
+    const char * p = data;
+    while (bytes > 0) {
+#if defined(MSG_NOSIGNAL)
+        /* A reader hanging up must not raise SIGPIPE. */
+        ssize_t written = event_log_socket ? send(event_log_fd, p, bytes, MSG_NOSIGNAL) : write(event_log_fd, p, bytes);
+#else
+        ssize_t written = write(event_log_fd, p, bytes);
+#endif
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "WARN: Unable to write event log %s. Dropping events until it can be reopened.\n", event_log_path);
+            close(event_log_fd);
+            event_log_fd = -1;
+            return false;
+        }
+        p += written;
+        bytes -= written;
+        event_log_bytes += written;
+    }
+    return true;
+}
+
+/*
+ * Open the event log: connect to the Unix socket named after
+ * EVENT_LOG_UNIX_PREFIX, or else open the file for appending. A header goes
+ * first, unless appending to a file which already has one.
+ *
+ * Returns false if the log can't be opened.
+ */
+bool
+open_event_log(void)
+{
+    if (event_log_socket) {
+        const char * path = event_log_path + strlen(EVENT_LOG_UNIX_PREFIX);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path)) return false;
+        strcpy(addr.sun_path, path);
+        if ((event_log_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return false;
+        if (connect(event_log_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            close(event_log_fd);
+            event_log_fd = -1;
+            return false;
+        }
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+        int on = 1;
+        setsockopt(event_log_fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        event_log_bytes = 0;
+    } else {
+        if ((event_log_fd = open(event_log_path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) return false;
+        off_t size = lseek(event_log_fd, 0, SEEK_END);
+        event_log_bytes = (size > 0) ? size : 0;
+    }
+    set_fd_flags(event_log_fd, false);
+
+    if (event_log_bytes > 0) return true;
+    struct event_log_header header = { EVENT_LOG_MAGIC, EVENT_LOG_VERSION, sizeof(struct event_record) };
+    return write_event_log(&header, sizeof(header));
+}
+
+/*
+ * Body of the event log writer thread. Drains every shard's ring straight
+ * from the ring's memory, sleeping EVENT_LOG_POLL_INTERVAL whenever all are
+ * empty, so shards never make a system call to log. While the log can't be
+ * written, events are discarded.
+ */
+void *
+event_log_thread(void * ignore)
+{
+    uint64_t next_open = 0;
+    while (true) {
+        bool idle = true;
+
+        if (event_log_fd < 0 && monotonic_usec() >= next_open && !open_event_log()) {
+            if (next_open == 0) fprintf(stderr, "WARN: Unable to open event log %s. Retrying in background.\n", event_log_path);
+            next_open = monotonic_usec() + EVENT_LOG_RETRY;
+        }
+
+        for (int i = 0; i < shard_count; i++) {
+            struct event_ring * ring = &shards[i].event_ring;
+            uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            while (tail != head) {
+                /* Write up to the end of the ring, then wrap around. */
+                size_t start = tail % EVENT_RING_RECORDS;
+                size_t count = head - tail;
+                if (start + count > EVENT_RING_RECORDS) count = EVENT_RING_RECORDS - start;
+                if (event_log_fd >= 0) write_event_log(&ring->records[start], count * sizeof(struct event_record));
+                tail += count;
+                atomic_store_explicit(&ring->tail, tail, memory_order_release);
+                idle = false;
+            }
+        }
+
+        /* Keep one previous log file. */
+        if (event_log_fd >= 0 && !event_log_socket && event_log_bytes >= EVENT_LOG_ROTATE_BYTES) {
+            char rotated[PATH_MAX];
+            close(event_log_fd);
+            event_log_fd = -1;
+            if (snprintf(rotated, sizeof(rotated), "%s.1", event_log_path) < (int) sizeof(rotated)) rename(event_log_path, rotated);
+            next_open = 0;
+        }
+
+        if (idle) {
+            struct timespec pause = { 0, EVENT_LOG_POLL_INTERVAL * 1000 };
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Allocate every shard's event ring and start the writer thread, with signals
+ * blocked so they reach the main thread.
+ */
+void
+init_event_log(void)
+{
+    event_log_socket = (strncmp(event_log_path, EVENT_LOG_UNIX_PREFIX, strlen(EVENT_LOG_UNIX_PREFIX)) == 0);
+    for (int i = 0; i < shard_count; i++) {
+        if ((shards[i].event_ring.records = malloc(EVENT_RING_RECORDS * sizeof(struct event_record))) == NULL) {
+            fprintf(stderr, "ERROR: Unable to allocate event log ring.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, event_log_thread, NULL) != 0) {
+        fprintf(stderr, "ERROR: Unable to start event log thread.\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+}
+
+/*
+ * Return the length of the socket address in `addr`.
+ */
+socklen_t
+host_addr_len(const union host_addr * addr)
+{
+    return (addr->sa.sa_family == AF_INET6) ? sizeof(addr->v6) : sizeof(addr->v4);
+}
+
+/*
+ * Return true if `a` and `b` hold the same IP address.
+ */
+bool
+host_addr_equal(const union host_addr * a, const union host_addr * b)
+{
+    if (a->sa.sa_family != b->sa.sa_family) return false;
+    if (a->sa.sa_family == AF_INET6) return memcmp(&a->v6.sin6_addr, &b->v6.sin6_addr, sizeof(a->v6.sin6_addr)) == 0;
+    return a->v4.sin_addr.s_addr == b->v4.sin_addr.s_addr;
+}
+
+/*
+ * Format the IP address in `addr` as a string in `buf`, returning `buf`.
+ */
+const char *
+host_addr_string(const union host_addr * addr, char * buf, size_t len)
+{
+    const void * ip = (addr->sa.sa_family == AF_INET6) ? (const void *) &addr->v6.sin6_addr
+                                                       : (const void *) &addr->v4.sin_addr;
+    if (inet_ntop(addr->sa.sa_family, ip, buf, len) == NULL) snprintf(buf, len, "(unknown)");
+    return buf;
+}
+
+/*
+ * Return the shared socket used to ping addresses of `family`.
+ */
+struct probe_socket *
+probe_socket_for(int family)
+{
+    return (family == AF_INET6) ? &shard->icmp6_socket : &shard->icmp4_socket;
+}
+
+/*
+ * Hash an (address, ICMP identifier) pair into a bucket of `host_hash`.
+ * The identifier is in network byte order.
+ */
+size_t
+host_hash_bucket(const union host_addr * addr, uint16_t ident)
+{
+    uint32_t key = (uint32_t) ident << 16 | ident;
+    if (addr->sa.sa_family == AF_INET6) {
+        uint32_t words[4];
+        memcpy(words, &addr->v6.sin6_addr, sizeof(words));
+        key ^= words[0] ^ words[1] ^ words[2] ^ words[3];
+    } else {
+        key ^= addr->v4.sin_addr.s_addr;
+    }
+    key *= 0x9E3779B1; /* Knuth's multiplicative hash. */
+    return (key ^ (key >> 16)) & shard->host_hash_mask;
+}
+
+/*
+ * Find the host which sent a probe with identifier `ident` to address `addr`.
+ *
+ * Returns NULL if no such host exists.
+ */
+struct host_entry *
+host_hash_lookup(const union host_addr * addr, uint16_t ident)
+{
+    struct host_entry * host = shard->host_hash[host_hash_bucket(addr, ident)];
+    while (host) {
+        if (host->ident == ident && host_addr_equal(&host->dest, addr)) return host;
+        host = host->hash_next;
+    }
+    return NULL;
+}
+
+/*
+ * Add a resolved host to the reply demultiplexing table.
+ *
+ * Identifiers keep hosts sharing an address apart, except where the kernel
+ * imposes one identifier on every echo request sent through a socket.
+ */
+void
+host_hash_insert(struct host_entry * host)
+{
+    if (host_hash_lookup(&host->dest, host->ident)) {
+        fprintf(stderr, "WARN: Host %s shares an address with another host. With -u, replies "
+                        "are credited to only one of them.\n", host->config->name);
+    }
+
+    size_t bucket = host_hash_bucket(&host->dest, host->ident);
+    host->hash_next = shard->host_hash[bucket];
+    shard->host_hash[bucket] = host;
+}
+
+/*
+ * Remove a host from the reply demultiplexing table. Must be called before
+ * changing the host's address or identifier.
+ */
+void
+host_hash_remove(struct host_entry * host)
+{
+    struct host_entry ** link = &shard->host_hash[host_hash_bucket(&host->dest, host->ident)];
+    while (*link && *link != host) link = &(*link)->hash_next;
+    if (*link) *link = host->hash_next;
+}
+
+/*
+ * Attach a classic BPF program to `sock` passing only echo replies carrying
+ * one of the `ident_count` identifiers starting at `first_ident` (host byte
+ * order). Other tools' pings, unreachables and the echo requests we answer
+ * are then dropped by the kernel instead of being copied to us and ignored.
+ */
+void
+attach_reply_filter(struct probe_socket * sock, uint16_t first_ident, size_t ident_count)
+{
+    /* Datagram sockets only ever deliver replies to their own echo requests. */
+    if (sock->fd < 0 || sock->datagram) return;
+#if defined(SO_ATTACH_FILTER)
+    /* IPv4 raw sockets see the IP header, so find its length. ICMPv6 starts at offset zero. */
+    bool ipv6 = (sock->family == AF_INET6);
+    struct sock_filter find_ipv4_header = BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0);
+    struct sock_filter no_header        = BPF_STMT(BPF_LDX | BPF_IMM, 0);
+    uint32_t count = (ident_count > 0xFFFF) ? 0x10000 : ident_count;
+
+    struct sock_filter program[] = {
+        ipv6 ? no_header : find_ipv4_header,
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),                                /* Type */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ipv6 ? ICMP6_ECHO_REPLY : ICMP_ECHOREPLY, 0, 4),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 4),                                /* Identifier */
+        BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, first_ident),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xFFFF),
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, count, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0),                                         /* Drop */
+        BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),                                /* Accept */
+    };
+    struct sock_fprog fprog = { sizeof(program) / sizeof(program[0]), program };
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        fprintf(stderr, "WARN: Unable to attach reply filter to %s socket.\n", ipv6 ? "ICMPv6" : "ICMP");
+    }
+#endif
+}
+
+/*
+ * Give `host` the next ICMP identifier of this shard. Identifiers are
+ * consecutive from our PID across the shards, so concurrent instances rarely
+ * collide and each shard's kernel filter need only check a range. They wrap
+ * within the range, as they only need to be unique among hosts sharing an
+ * address. Where the kernel overwrites identifiers, replies are matched on
+ * address alone.
+ */
+void
+assign_ident(struct host_entry * host)
+{
+    uint16_t ident = shard->first_ident + shard->next_ident++ % shard->ident_span;
+    host->ident = shard->icmp4_socket.kernel_echo ? 0 : htons(ident);
+}
+
+/*
+ * (Re)build the reply demultiplexing table from this shard's resolved hosts,
+ * sized for its current host count.
+ */
+void
+build_host_hash(void)
+{
+    size_t buckets = 1;
+    while (buckets < shard->host_count * HOST_HASH_LOAD_FACTOR) buckets <<= 1;
+
+    free(shard->host_hash);
+    if ((shard->host_hash = calloc(buckets, sizeof(*shard->host_hash))) == NULL) {
+        fprintf(stderr, "ERROR: Unable to allocate host hash table.\n");
+        exit(EXIT_FAILURE);
+    }
+    shard->host_hash_mask = buckets - 1;
+
+    for (size_t r = 0; r < shard->range_count; r++) {
+        struct host_entry * host = shard->ranges[r].hosts;
+        for (size_t i = 0; i < shard->ranges[r].count; i++, host++) {
+            if (host->resolved && !host->removed) host_hash_insert(host);
+        }
+    }
+}
+
+/*
+ * Return true if `host` has parents and every one of them is down or itself
+ * unreachable, so that its silence says nothing about the host. Parents on
+ * other shards are judged by the state they publish.
+ */
+bool
+parents_down(const struct host_entry * host)
+{
+    for (size_t i = 0; i < host->parent_count; i++) {
+        const struct host_entry * parent = host->parents[i];
+        if (atomic_load_explicit(&parent->metrics.up, memory_order_relaxed)
+            && !atomic_load_explicit(&parent->unreachable, memory_order_relaxed)) return false;
+    }
+    return host->parent_count > 0;
+}
+
+/*
+ * Return 0 unless some parent of `host` is up but hasn't answered since
+ * `silent_since`, when the host's first unanswered ping was sent. The parent
+ * might then be about to go down too, so the host's silence can't be judged
+ * yet. The return value is how soon to look again: the shortest interval of
+ * such a parent, within which its next ping is either answered or counts
+ * towards its deadline. A parent is waited for no longer than its own
+ * `max_delay` and an interval, in case it isn't being pinged at all.
+ */
+uint64_t
+parents_pending(const struct host_entry * host, uint64_t silent_since, uint64_t now)
+{
+    uint64_t recheck = 0;
+    for (size_t i = 0; i < host->parent_count; i++) {
+        const struct host_entry * parent = host->parents[i];
+        if (!atomic_load_explicit(&parent->metrics.up, memory_order_relaxed)
+            || atomic_load_explicit(&parent->unreachable, memory_order_relaxed)) continue;
+        if (atomic_load_explicit(&parent->last_reply, memory_order_relaxed) >= silent_since
+            || now >= silent_since + parent->max_delay + parent->ping_interval) return 0;
+        if (recheck == 0 || parent->ping_interval < recheck) recheck = parent->ping_interval;
+    }
+    return recheck;
+}
+
+/*
+ * Called when `host` has missed enough pings to go down. Returns true,
+ * marking it unreachable, if its parents are down. No DOWN command is then
+ * executed for it, the parent's being the root cause, and its pings back off
+ * until check_deadline() finds a parent back.
+ */
+bool
+host_unreachable(struct host_entry * host)
+{
+    if (!parents_down(host)) return false;
+    if (!atomic_load_explicit(&host->unreachable, memory_order_relaxed)) {
+        if (verbose) printf("INFO: Host %s is unreachable while its parents are down.\n", host->config->name);
+        atomic_store_explicit(&host->unreachable, true, memory_order_relaxed);
+        log_event(host, EVENT_UNREACHABLE, host->seq - 1, -1);
+    }
+    timer_schedule(&host->deadline_timer, monotonic_usec() + host->ping_interval);
+    return true;
+}
+
+/*
+ * Clear `host` being unreachable, forgetting the pings it lost meanwhile.
+ */
+void
+host_reachable(struct host_entry * host)
+{
+    if (verbose) printf("INFO: Host %s is reachable again.\n", host->config->name);
+    atomic_store_explicit(&host->unreachable, false, memory_order_relaxed);
+    host->loss_bits      = 0;
+    host->window_pending = false;
+}
+
+/*
+ * Bring the next ping to `host` forward to the next slot of its regular
+ * interval, should backing off have pushed it further out.
+ */
+void
+resume_ping_interval(struct host_entry * host, uint64_t now)
+{
+    host->down_interval = 0;
+    if (host->resolved && !host->send_slot_reserved && host->next_ping_due > now) {
+        host->next_ping_due -= (host->next_ping_due - now) / host->ping_interval * host->ping_interval;
+        timer_schedule(&host->send_timer, host->next_ping_due);
+    }
+}
+
+/*
+ * Called by the scheduler once a host has gone `max_delay` without a
+ * reply. Executes the DOWN command and, with `-r`, rearms itself to repeat the
+ * command each time another ping goes unanswered.
+ */
+void
+check_deadline(void * context)
+{
+    struct host_entry * host = context;
+    uint64_t now = monotonic_usec();
+
+    /* A reply arrived since this deadline was set. Push it back rather than reschedule on every reply. */
+    if (now - host->last_ping_received < host->max_delay) {
+        timer_schedule(&host->deadline_timer, host->last_ping_received + host->max_delay);
+        return;
+    }
+
+    /* Unreachable hosts are checked every interval for a parent coming back. */
+    if (atomic_load_explicit(&host->unreachable, memory_order_relaxed)) {
+        if (parents_down(host)) {
+            timer_schedule(&host->deadline_timer, now + host->ping_interval);
+            return;
+        }
+        /* Give the host a fresh `max_delay` to answer, pulling its backed off ping forward. */
+        host_reachable(host);
+        resume_ping_interval(host, now);
+        timer_schedule(&host->deadline_timer, now + host->max_delay);
+        return;
+    }
+
+    /* Hold back while a parent, as quiet as the host, might yet be found down. */
+    uint64_t recheck = parents_pending(host, host->unanswered_since, now);
+    if (recheck) {
+        timer_schedule(&host->deadline_timer, now + recheck);
+        return;
+    }
+
+    counter_add(&host->metrics.counts[HOST_TIMEOUTS], 1);
+    counter_add(&shard->metrics.counts[SHARD_TIMEOUTS], 1);
+    log_event(host, EVENT_TIMEOUT, host->seq - 1, -1);
+    if (host_unreachable(host)) return;
+
+    if (host->state_unknown) {
+        /* Starting in `auto`, the first deadline missed only settles the state. */
+        if (verbose) printf("INFO: Host %s is down at startup.\n", host->config->name);
+        host->state_unknown = false;
+        set_host_up(host, false);
+    } else if (host->host_up || host->retry_down_cmd) {
+        if (verbose) printf("INFO: Host %s stopped responding. Executing DOWN command.\n", host->config->name);
+        set_host_up(host, false);
+        report_transition(host, false);
+    }
+
+    /* Otherwise the deadline is rearmed by read_icmp_data() once the host responds. */
+    if (host->retry_down_cmd) timer_schedule(&host->deadline_timer, now + (host->down_interval ? host->down_interval : host->ping_interval));
+}
+
+/*
+ * Claim the next send slot from this shard's rate limiter, returning the time
+ * at which the caller may send. Slots are spaced `rate_limit_gap` apart.
+ */
+uint64_t
+rate_limit_reserve(uint64_t now)
+{
+    uint64_t slot = (shard->rate_limit_next > now) ? shard->rate_limit_next : now;
+    shard->rate_limit_next = slot + rate_limit_gap;
+    return slot;
+}
+
+/*
+ * Record the outcome of sending the probe in `slot`.
+ */
+void
+send_complete(struct send_slot * slot, bool sent, uint64_t now)
+{
+    if (!slot->pmtu_probe) log_event(slot->host, sent ? EVENT_SENT : EVENT_SEND_ERROR, ntohs(slot->seq), -1);
+    if (sent) {
+        counter_add(&slot->host->metrics.counts[HOST_PROBES_SENT], 1);
+        counter_add(&shard->metrics.counts[SHARD_PROBES_SENT], 1);
+        slot->host->last_ping_sent = now;
+#if defined(SO_TIMESTAMPING)
+        /* The kernel numbers transmit timestamps in send order, starting from zero. */
+        if (kernel_timestamps) {
+            struct probe_socket * sock = probe_socket_for(slot->host->dest.sa.sa_family);
+            struct tx_record * record = &sock->tx_ring[sock->tx_next_key++ % TX_RING_SIZE];
+            record->host = slot->pmtu_probe ? NULL : slot->host;
+            record->seq  = slot->seq;
+        }
+#endif
+        return;
+    }
+
+    counter_add(&shard->metrics.counts[SHARD_SEND_ERRORS], 1);
+    if (slot->pmtu_probe && errno == EMSGSIZE) {
+        /* The path MTU probe is larger than the local interface allows, so don't wait for an answer. */
+        slot->host->pmtu_attempts = PMTU_PROBE_ATTEMPTS;
+        timer_schedule(&slot->host->pmtu_timer, now);
+    } else {
+        fprintf(stderr, "WARN: Failed sending ICMP packet to %s.\n", slot->host->config->name);
+    }
+}
+
+/*
+ * Set or clear the don't fragment bit on probes subsequently sent through `sock`.
+ */
+void
+set_dont_fragment(struct probe_socket * sock, bool dont_fragment)
+{
+#if defined(HAVE_DONT_FRAGMENT)
+    if (sock->dont_fragment == dont_fragment) return;
+    sock->dont_fragment = dont_fragment;
+
+    int on = dont_fragment;
+    bool failed = false;
+    if (sock->family == AF_INET6) {
+        failed |= setsockopt(sock->fd, IPPROTO_IPV6, IPV6_DONTFRAG, &on, sizeof(on)) < 0;
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+        int mode = dont_fragment ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_WANT;
+        failed |= setsockopt(sock->fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &mode, sizeof(mode)) < 0;
+#endif
+    } else {
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+        int mode = dont_fragment ? IP_PMTUDISC_PROBE : IP_PMTUDISC_DONT;
+        failed |= setsockopt(sock->fd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode)) < 0;
+#else
+        failed |= setsockopt(sock->fd, IPPROTO_IP, IP_DONTFRAG, &on, sizeof(on)) < 0;
+#endif
+    }
+    if (failed) fprintf(stderr, "WARN: Unable to %s the don't fragment bit.\n", dont_fragment ? "set" : "clear");
+#endif
+}
+
+/*
+ * Send every queued probe, using one sendmmsg() per run of probes sharing an
+ * address family and don't fragment setting where available.
+ */
+void
+send_batch_flush(void)
+{
+    if (shard->send_batch_count == 0) return;
+
+#if defined(HAVE_MMSG)
+    for (int i = 0; i < shard->send_batch_count; i++) {
+        shard->send_iovs[i].iov_base = (void *) shard->send_batch[i].packet;
+        shard->send_iovs[i].iov_len  = shard->send_batch[i].bytes;
+        memset(&shard->send_msgs[i], 0, sizeof(shard->send_msgs[i]));
+        shard->send_msgs[i].msg_hdr.msg_name    = &shard->send_batch[i].host->dest;
+        shard->send_msgs[i].msg_hdr.msg_namelen = host_addr_len(&shard->send_batch[i].host->dest);
+        shard->send_msgs[i].msg_hdr.msg_iov     = &shard->send_iovs[i];
+        shard->send_msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    /* sendmmsg() stops at the first failing packet. Report it and carry on with the rest. */
+    int done = 0;
+    while (done < shard->send_batch_count) {
+        int family = shard->send_batch[done].host->dest.sa.sa_family;
+        bool dont_fragment = shard->send_batch[done].dont_fragment;
+        int run = 1;
+        while (done + run < shard->send_batch_count && shard->send_batch[done + run].host->dest.sa.sa_family == family
+               && shard->send_batch[done + run].dont_fragment == dont_fragment) run++;
+
+        struct probe_socket * sock = probe_socket_for(family);
+        set_dont_fragment(sock, dont_fragment);
+        int sent = sendmmsg(sock->fd, &shard->send_msgs[done], run, 0);
+        uint64_t now = monotonic_usec();
+        if (sent <= 0) {
+            send_complete(&shard->send_batch[done++], false, now);
+            continue;
+        }
+        for (int i = done; i < done + sent; i++) {
+            send_complete(&shard->send_batch[i], shard->send_msgs[i].msg_len == shard->send_batch[i].bytes, now);
+        }
+        done += sent;
+    }
+#else
+    for (int i = 0; i < shard->send_batch_count; i++) {
+        struct send_slot * slot = &shard->send_batch[i];
+        const union host_addr * dest = &slot->host->dest;
+        struct probe_socket * sock = probe_socket_for(dest->sa.sa_family);
+        set_dont_fragment(sock, slot->dont_fragment);
+        ssize_t bytes_sent = sendto(sock->fd, slot->packet, slot->bytes, 0, &dest->sa, host_addr_len(dest));
+        send_complete(slot, bytes_sent >= 0 && (size_t) bytes_sent == slot->bytes, monotonic_usec());
+    }
+#endif
+
+    shard->send_batch_count = 0;
+}
+
+/*
+ * Write an echo request header for `host` with sequence number `seq` into
+ * `packet`, followed by the current time, leaving the checksum zero.
+ */
+void
+write_echo_request(const struct host_entry * host, unsigned char * packet, uint16_t seq)
+{
+    /* ICMPv6 echo requests share the layout of their ICMP counterparts. */
+    struct icmp header;
+    header.icmp_type  = (host->dest.sa.sa_family == AF_INET6) ? ICMP6_ECHO_REQUEST : ICMP_ECHO;
+    header.icmp_code  = 0;
+    header.icmp_cksum = 0;
+    header.icmp_id    = host->ident;
+    header.icmp_seq   = seq;
+    memcpy(packet, &header, ICMP_ECHO_HEADER_BYTES);
+
+    struct timeval sent;
+    gettimeofday(&sent, NULL);
+    memcpy(packet + ICMP_ECHO_HEADER_BYTES, &sent, sizeof(sent));
+}
+
+/*
+ * Fill the echo data of `packet`, from `offset` up to `bytes`, with a fixed
+ * pattern after the timestamp, as ping(8) does.
+ */
+void
+fill_echo_padding(unsigned char * packet, size_t offset, size_t bytes)
+{
+    for (size_t i = offset; i < bytes; i++) packet[i] = (unsigned char) i;
+}
+
+/*
+ * Prepare the probe template of `host` for its current address family and
+ * identifier, checksummed in full once.
+ */
+void
+build_probe_template(struct host_entry * host)
+{
+    unsigned char * bytes = (unsigned char *) host->probe;
+    write_echo_request(host, bytes, htons(host->seq));
+    fill_echo_padding(bytes, ICMP_ECHO_PACKET_BYTES, host->probe_bytes);
+
+    /* The kernel computes ICMPv6 checksums itself, as they cover the IPv6 pseudo-header. */
+    host->probe_checksummed = host->dest.sa.sa_family != AF_INET6 && !shard->icmp4_socket.kernel_echo;
+    if (host->probe_checksummed) host->probe[1] = checksum(host->probe, host->probe_bytes);
+}
+
+/*
+ * Queue the packet of `bytes` at `packet` for sending to `host`, flushing the
+ * batch first if it is full.
+ */
+struct send_slot *
+queue_probe(struct host_entry * host, const void * packet, size_t bytes, uint16_t seq)
+{
+    if (shard->send_batch_count == SEND_BATCH_SIZE) send_batch_flush();
+    struct send_slot * slot = &shard->send_batch[shard->send_batch_count++];
+    slot->host          = host;
+    slot->packet        = packet;
+    slot->bytes         = bytes;
+    slot->seq           = seq;
+    slot->dont_fragment = host->dont_fragment;
+    slot->pmtu_probe    = false;
+    return slot;
+}
+
+/*
+ * With `loss_window`, judge the previous ping to `host`, lost unless answered
+ * by now, as the next is about to be sent. Executes the DOWN command once
+ * `down_after` of the last `loss_window` pings have been lost, unless held
+ * back by parents_pending(), in which case the next ping lost judges again.
+ */
+void
+judge_last_ping(struct host_entry * host)
+{
+    bool judged = host->window_pending;
+    bool lost   = !host->window_answered;
+    host->window_pending  = true;
+    host->window_answered = false;
+    if (!judged) return;
+
+    host->loss_bits = (host->loss_bits << 1) | lost;
+    if (!lost) return;
+    host->reply_streak = 0;
+
+    uint64_t bits = host->loss_bits & ((host->loss_window == MAX_LOSS_WINDOW) ? UINT64_MAX : (1ULL << host->loss_window) - 1);
+    int losses = 0;
+    for (; bits; bits &= bits - 1) losses++;
+    if (losses >= host->down_after && host->host_up && !host->state_unknown
+        && !parents_pending(host, host->unanswered_since, monotonic_usec()) && !host_unreachable(host)) {
+        if (verbose) printf("INFO: Host %s lost %d of its last %d pings. Executing DOWN command.\n",
+                            host->config->name, losses, host->loss_window);
+        set_host_up(host, false);
+        report_transition(host, false);
+    }
+}
+
+/*
+ * Return how long to wait after the ping being sent to `host` before the next,
+ * given whether the previous ping was `missed`. Down hosts back off, doubling
+ * the interval up to `max_down_interval`. Hosts which are up but missed a ping
+ * are confirmed at `confirm_interval` until they are found up or down.
+ */
+uint64_t
+next_ping_interval(struct host_entry * host, bool missed)
+{
+    if (atomic_load_explicit(&host->unreachable, memory_order_relaxed)) return host->ping_interval * UNREACHABLE_BACKOFF;
+
+    if (host->max_down_interval && !host->host_up && !host->state_unknown && !host->pmtu_degraded) {
+        host->down_interval = host->down_interval ? 2 * host->down_interval : host->ping_interval;
+        if (host->down_interval > host->max_down_interval) host->down_interval = host->max_down_interval;
+        return host->down_interval;
+    }
+    host->down_interval = 0;
+
+    if (host->confirm_interval && missed && host->host_up) return host->confirm_interval;
+    return host->ping_interval;
+}
+
+/*
+ * Called by the scheduler each time a ping to `host` is due. The probe is
+ * queued and sent by send_batch_flush() along with any others due now.
+ */
+void
+pinger(void * context)
+{
+    struct host_entry * host = context;
+
+    /* With `-l`, defer this ping until the slot reserved for it comes around. */
+    if (rate_limit_gap && !host->send_slot_reserved) {
+        uint64_t slot = rate_limit_reserve(monotonic_usec());
+        if (slot > monotonic_usec()) {
+            host->send_slot_reserved = true;
+            timer_schedule(&host->send_timer, slot);
+            return;
+        }
+    }
+    host->send_slot_reserved = false;
+
+    if (host->loss_window) judge_last_ping(host);
+    bool missed = host->last_ping_sent && !host->last_ping_answered;
+    host->last_ping_answered = false;
+
+    if (verbose) printf("INFO: Sending ICMP packet to %s.\n", host->config->name);
+
+    /* Patch the sequence number and a timestamp, for calculating travel times, into the template. */
+    uint16_t old[PROBE_VARYING_WORDS];
+    memcpy(old, &host->probe[PROBE_FIRST_VARYING_WORD], sizeof(old));
+    uint16_t seq = htons(host->seq++);
+    host->last_ping_seq = seq;
+    host->probe[PROBE_FIRST_VARYING_WORD] = seq;
+    struct timeval sent;
+    gettimeofday(&sent, NULL);
+    memcpy(&host->probe[PROBE_FIRST_VARYING_WORD + 1], &sent, sizeof(sent));
+    if (host->probe_checksummed) {
+        host->probe[1] = checksum_update(host->probe[1], old, &host->probe[PROBE_FIRST_VARYING_WORD], PROBE_VARYING_WORDS);
+    }
+
+    /* A host has at most one probe in each batch, so it is sent straight from the template. */
+    queue_probe(host, host->probe, host->probe_bytes, seq);
+
+    /* Keep a fixed phase unless we've fallen more than a whole interval behind. */
+    uint64_t now = monotonic_usec();
+    if (!missed) host->unanswered_since = now;
+    uint64_t interval = next_ping_interval(host, missed);
+    host->next_ping_due += interval;
+    if (host->next_ping_due <= now) host->next_ping_due = now + interval;
+    timer_schedule(&host->send_timer, host->next_ping_due);
+}
+
+/*
+ * Send a path MTU probe of `size` bytes, IP header included, to `host` with
+ * the don't fragment bit set, allowing PMTU_PROBE_TIMEOUT for an answer.
+ */
+void
+send_pmtu_probe(struct host_entry * host, uint32_t size, uint64_t now)
+{
+    size_t bytes = size - ((host->dest.sa.sa_family == AF_INET6) ? IPV6_HEADER_BYTES : IPV4_HEADER_BYTES);
+    uint16_t seq = htons(host->seq++);
+    write_echo_request(host, host->pmtu_packet, seq);
+    if (host->probe_checksummed) {
+        uint16_t sum = checksum(host->pmtu_packet, bytes);
+        memcpy(host->pmtu_packet + 2, &sum, sizeof(sum));
+    }
+    if (verbose) printf("INFO: Probing path MTU to %s with %u bytes.\n", host->config->name, size);
+
+    struct send_slot * slot = queue_probe(host, host->pmtu_packet, bytes, seq);
+    slot->dont_fragment = true;
+    slot->pmtu_probe    = true;
+    host->pmtu_size = size;
+    host->pmtu_seq  = seq;
+    timer_schedule(&host->pmtu_timer, now + PMTU_PROBE_TIMEOUT);
+}
+
+/*
+ * Record the result of a path MTU search of `host`, holding the host down
+ * while its path MTU is below `pmtu_min`.
+ */
+void
+pmtu_search_done(struct host_entry * host, uint32_t mtu)
+{
+    struct host_config * config = host->config;
+    if (host->path_mtu && mtu < host->path_mtu) {
+        fprintf(stderr, "WARN: Path MTU to %s dropped from %u to %u bytes.\n", config->name, host->path_mtu, mtu);
+    } else if (verbose && mtu != host->path_mtu) {
+        printf("INFO: Path MTU to %s is %u bytes.\n", config->name, mtu);
+    }
+    host->path_mtu = mtu;
+
+    if (mtu < config->pmtu_min && !host->pmtu_degraded) {
+        host->pmtu_degraded = true;
+        if (host->host_up) {
+            if (verbose) printf("INFO: Path MTU to %s is below %u bytes. Executing DOWN command.\n", config->name, config->pmtu_min);
+            set_host_up(host, false);
+            report_transition(host, false);
+        }
+    } else if (mtu >= config->pmtu_min && host->pmtu_degraded) {
+        /* The host comes back up with its next reply. */
+        host->pmtu_degraded = false;
+    }
+}
+
+/*
+ * Called by the scheduler when a path MTU probe of `host` goes unanswered,
+ * was just answered, or a new search is due.
+ *
+ * Each search begins by probing the last path MTU found. Should it be
+ * answered, a path MTU of `pmtu_max` needs no more probes, and neither does a
+ * smaller one which a full search found to be the limit within the last
+ * PMTU_FULL_SEARCH_INTERVAL, so a stable path costs a single probe. Otherwise
+ * the largest size answered is found by binary search, never going below the
+ * minimum MTU of the IP version.
+ */
+void
+pmtu_timer_fired(void * context)
+{
+    struct host_entry * host = context;
+    uint64_t now = monotonic_usec();
+
+    if (host->pmtu_size) {
+        /* Random loss mustn't pass for an MTU limit, so retry before giving up on a size. */
+        if (++host->pmtu_attempts < PMTU_PROBE_ATTEMPTS) {
+            send_pmtu_probe(host, host->pmtu_size, now);
+            return;
+        }
+        host->pmtu_high = host->pmtu_size - 1;
+        host->pmtu_size = 0;
+        host->pmtu_confirming = false;
+    } else if (host->pmtu_low == 0) {
+        /* Every probe to an unresponsive host would be lost. */
+        if (!host->host_up && !host->pmtu_degraded) {
+            timer_schedule(&host->pmtu_timer, now + host->ping_interval);
+            return;
+        }
+        uint32_t max = host->config->pmtu_max;
+        uint32_t min = (host->dest.sa.sa_family == AF_INET6) ? PMTU_MIN_IPV6 : PMTU_MIN_IPV4;
+        host->pmtu_low      = (min < max) ? min : max;
+        host->pmtu_high     = max;
+        host->pmtu_attempts = 0;
+        bool known = host->path_mtu >= host->pmtu_low && host->path_mtu <= max;
+        host->pmtu_confirming = known && host->path_mtu < max && now - host->pmtu_searched < PMTU_FULL_SEARCH_INTERVAL;
+        send_pmtu_probe(host, known ? host->path_mtu : max, now);
+        return;
+    }
+
+    if (host->pmtu_low < host->pmtu_high) {
+        host->pmtu_attempts = 0;
+        send_pmtu_probe(host, (host->pmtu_low + host->pmtu_high + 1) / 2, now);
+        return;
+    }
+    pmtu_search_done(host, host->pmtu_low);
+    if (!host->pmtu_confirming) host->pmtu_searched = now;
+    host->pmtu_confirming = false;
+    host->pmtu_low = 0;
+    timer_schedule(&host->pmtu_timer, now + PMTU_SEARCH_INTERVAL);
+}
+
+/*
+ * Note the answer to the path MTU probe of `host` in flight, continuing the
+ * search straight away.
+ */
+void
+pmtu_probe_answered(struct host_entry * host, uint64_t now)
+{
+    host->pmtu_low  = host->pmtu_size;
+    host->pmtu_size = 0;
+    if (host->pmtu_confirming) host->pmtu_high = host->pmtu_low;
+    timer_schedule(&host->pmtu_timer, now);
+}
+
+/*
+ * Start pinging a resolved host and begin watching for missed `max_delay`
+ * deadlines, measured from its first ping. Path MTU discovery starts once
+ * the first ping has had time to be answered.
+ */
+void
+activate_host(struct host_entry * host, uint64_t now)
+{
+    build_probe_template(host);
+    host->send_slot_reserved = false;
+    host->next_ping_due = now + host->phase;
+    uint64_t deadline = host->next_ping_due + host->max_delay;
+    if (host->config->pmtu_discovery) timer_schedule(&host->pmtu_timer, host->next_ping_due + PMTU_PROBE_TIMEOUT);
+
+    if (host->sweep_pending) {
+        /* Hosts starting in `auto` get an extra ping at once, ahead of their phase. Those */
+        /* restored from the state file keep their last reply time, but get some grace.   */
+        host->sweep_pending = false;
+        host->next_ping_due -= host->ping_interval;
+        timer_schedule(&host->send_timer, now);
+        if (host->state_unknown) {
+            host->last_ping_received = now;
+            deadline = now + host->max_delay;
+        } else {
+            uint64_t grace = now + ((host->max_delay < RESTORE_GRACE) ? host->max_delay : RESTORE_GRACE);
+            deadline = host->last_ping_received + host->max_delay;
+            if (deadline < grace) deadline = grace;
+        }
+    } else {
+        host->last_ping_received = now;
+        timer_schedule(&host->send_timer, host->next_ping_due);
+    }
+    timer_schedule(&host->deadline_timer, deadline);
+}
+
+/*
+ * Start pinging every resolved host in this shard. Others start once resolved.
+ *
+ * The first ping to each host is offset by a fraction of its interval so that
+ * hosts are spread evenly across their intervals rather than pinged in bursts.
+ */
+void
+schedule_hosts(void)
+{
+    assert(shard->range_count == 1);
+
+    uint64_t now = monotonic_usec();
+    struct host_entry * host = shard->ranges[0].hosts;
+    for (size_t i = 0; i < shard->ranges[0].count; i++, host++) {
+        host->phase = host->ping_interval * (shard->first_index + i) / total_hosts;
+        if (host->resolved) activate_host(host, now);
+    }
+}
+
+/*
+ * Parse the `bytes` bytes at `packet`, led by an IPv4 header if `ip_header`,
+ * as an echo reply of ICMP or ICMPv6 type `reply_type`, filling in `reply`.
+ * Nothing beyond `bytes` is read and nothing is assumed of alignment, so any
+ * input at all is safe.
+ */
+enum reply_parse
+parse_echo_reply(const unsigned char * packet, size_t bytes, bool ip_header, int reply_type, struct echo_reply * reply)
+{
+    size_t header_bytes = 0;
+    if (ip_header) {
+        if (bytes < IPV4_HEADER_BYTES) return REPLY_SHORT;
+        header_bytes = (packet[0] & 0x0f) << 2;
+        if ((packet[0] >> 4) != 4 || header_bytes < IPV4_HEADER_BYTES) return REPLY_FOREIGN;
+    }
+    if (bytes < header_bytes + ICMP_MINLEN) return REPLY_SHORT;
+
+    /* ICMPv6 echo replies share the ICMP layout: type, code, checksum, identifier and sequence number. */
+    const unsigned char * icmp = packet + header_bytes;
+    if (icmp[0] != reply_type) return REPLY_FOREIGN;
+    memcpy(&reply->ident, icmp + 4, sizeof(reply->ident));
+    memcpy(&reply->seq, icmp + 6, sizeof(reply->seq));
+    reply->data       = icmp + ICMP_ECHO_HEADER_BYTES;
+    reply->data_bytes = bytes - header_bytes - ICMP_ECHO_HEADER_BYTES;
+    return REPLY_ECHO;
+}
+
+/*
+ * Examine one packet received on the shared socket `sock`, crediting any echo
+ * reply to the host which sent the matching probe.
+ */
+void
+process_icmp_packet(const struct probe_socket * sock, const unsigned char * packet, int bytes,
+                    const union host_addr * from, uint64_t now, const struct packet_times * received)
+{
+    struct echo_reply reply;
+    int reply_type = (sock->family == AF_INET6) ? ICMP6_ECHO_REPLY : ICMP_ECHOREPLY;
+    enum reply_parse parsed = parse_echo_reply(packet, bytes, sock->ip_header, reply_type, &reply);
+
+    if (parsed == REPLY_SHORT) {
+        char from_str[INET6_ADDRSTRLEN];
+        fprintf(stderr, "WARN: Received short packet from %s.\n", host_addr_string(from, from_str, sizeof(from_str)));
+        counter_add(&shard->metrics.counts[SHARD_SHORT_PACKETS], 1);
+        return;
+    }
+
+    struct host_entry * host = NULL;
+    if (parsed == REPLY_ECHO) host = host_hash_lookup(from, sock->kernel_echo ? 0 : reply.ident);
+
+    if (host) {
+        host->last_ping_received = now;
+        atomic_store_explicit(&host->last_reply, now, memory_order_relaxed);
+        if (host->deadline_timer.heap_index == TIMER_INACTIVE) {
+            timer_schedule(&host->deadline_timer, now + host->max_delay);
+        }
+
+        /* Answers to path MTU probes only advance the search. */
+        if (host->pmtu_size && reply.seq == host->pmtu_seq) {
+            pmtu_probe_answered(host, now);
+            return;
+        }
+
+        /* Prefer a pair of NIC timestamps, then kernel timestamps, for this exact probe. */
+        int64_t rtt = -1;
+        const struct packet_times * sent = &host->tx_times;
+        if (host->tx_stamped && host->tx_seq == reply.seq) {
+            if (timespec_isset(&sent->hardware) && timespec_isset(&received->hardware)) {
+                rtt = timespec_diff_usec(&received->hardware, &sent->hardware);
+            } else if (timespec_isset(&sent->software)) {
+                rtt = timespec_diff_usec(&received->software, &sent->software);
+            }
+        }
+
+        /* Otherwise use the send time pinger() echoed back in the data segment. */
+        if (rtt < 0 && reply.data_bytes >= ICMP_ECHO_DATA_BYTES) {
+            struct timeval echoed;
+            memcpy(&echoed, reply.data, sizeof(echoed));
+            struct timespec echoed_ts = { echoed.tv_sec, echoed.tv_usec * 1000 };
+            rtt = timespec_diff_usec(&received->software, &echoed_ts);
+        }
+
+        counter_add(&host->metrics.counts[HOST_REPLIES], 1);
+        counter_add(&shard->metrics.counts[SHARD_REPLIES], 1);
+        log_event(host, EVENT_REPLY, ntohs(reply.seq), (rtt <= UINT32_MAX) ? rtt : -1);
+
+        /* Discard nonsense caused by the wall clock stepping. */
+        if (rtt >= 0 && rtt <= UINT32_MAX) {
+            rtt_record(&host->rtt, rtt);
+            metrics_record_rtt(host, rtt);
+            if (verbose) printf("INFO: Got ICMP reply from %s in %.3f ms.\n", host->config->name, rtt / 1000.0);
+        } else {
+            if (verbose) printf("INFO: Got ICMP reply from %s.\n", host->config->name);
+        }
+        if (reply.seq == host->last_ping_seq) host->last_ping_answered = true;
+        if (host->down_interval) resume_ping_interval(host, monotonic_usec());
+
+        /* With `loss_window`, only a reply to the latest ping counts, and the host must answer `up_after` in a row. */
+        bool up_ready = true;
+        if (host->loss_window) {
+            if (host->window_pending && !host->window_answered && reply.seq == host->last_ping_seq) {
+                host->window_answered = true;
+                if (host->reply_streak < UINT8_MAX) host->reply_streak++;
+            }
+            up_ready = (host->reply_streak >= host->up_after);
+        }
+        if (atomic_load_explicit(&host->unreachable, memory_order_relaxed)) host_reachable(host);
+
+        if (host->state_unknown) {
+            /* Starting in `auto`, the first reply only settles the state. */
+            if (verbose) printf("INFO: Host %s is up at startup.\n", host->config->name);
+            host->state_unknown = false;
+            set_host_up(host, !host->pmtu_degraded);
+        } else if (!host->host_up && !host->pmtu_degraded && up_ready) {
+            if (verbose) printf("INFO: Host %s started responding. Executing UP command.\n", host->config->name);
+            set_host_up(host, true);
+            report_transition(host, true);
+        }
+    } else {
+        /* The packet isn't what we expected. Ignore it and move on. */
+        counter_add(&shard->metrics.counts[SHARD_FOREIGN_PACKETS], 1);
+    }
+}
+
+/*
+ * Replace the timestamps in `times` with any kernel or NIC timestamps found in
+ * the control messages of `msg`.
+ */
+void
+extract_timestamps(struct msghdr * msg, struct packet_times * times)
+{
+    for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET) continue;
+#if defined(SO_TIMESTAMPING)
+        if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+            if (timespec_isset(&stamps.ts[0])) times->software = stamps.ts[0];
+            if (timespec_isset(&stamps.ts[2])) times->hardware = stamps.ts[2];
+        }
+#elif defined(SO_TIMESTAMP)
+        if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+            struct timeval stamp;
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            times->software.tv_sec  = stamp.tv_sec;
+            times->software.tv_nsec = stamp.tv_usec * 1000;
+        }
+#endif
+    }
+}
+
+/*
+ * Ask the kernel to timestamp packets on the shared socket `sock`. On Linux this
+ * covers both directions, using NIC hardware timestamps where the interface
+ * has been configured to produce them. Elsewhere only receive timestamps are
+ * available.
+ */
+void
+enable_kernel_timestamps(struct probe_socket * sock)
+{
+    int retval = -1;
+#if defined(SO_TIMESTAMPING)
+    int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE
+              | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE
+              | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE
+              | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    retval = setsockopt(sock->fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+#elif defined(SO_TIMESTAMP)
+    int on = 1;
+    retval = setsockopt(sock->fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on));
+#endif
+    if (retval < 0) {
+        fprintf(stderr, "WARN: Kernel timestamps unavailable. Using userspace timestamps.\n");
+        kernel_timestamps = false;
+    }
+}
+
+/*
+ * Drain transmit timestamps from the error queue of `sock`, attaching each to
+ * the probe it belongs to. Must run before replies are processed so that a
+ * fast reply finds its probe's timestamp already in place.
+ */
+void
+read_tx_timestamps(struct probe_socket * sock)
+{
+#if defined(SO_TIMESTAMPING)
+    while (true) {
+        union control_buffer control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control    = control.bytes;
+        msg.msg_controllen = sizeof(control.bytes);
+        if (recvmsg(sock->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+
+        bool have_key = false;
+        uint32_t key = 0;
+        for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                struct sock_extended_err err;
+                memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+                if (err.ee_errno == ENOMSG && err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+                    have_key = true;
+                    key = err.ee_data;
+                }
+            }
+        }
+
+        struct tx_record * record = &sock->tx_ring[key % TX_RING_SIZE];
+        if (!have_key || record->host == NULL) continue;
+
+        /* Software and hardware timestamps for one probe may arrive separately. */
+        struct host_entry * host = record->host;
+        if (!host->tx_stamped || host->tx_seq != record->seq) {
+            memset(&host->tx_times, 0, sizeof(host->tx_times));
+            host->tx_stamped = true;
+            host->tx_seq = record->seq;
+        }
+        struct packet_times times = host->tx_times;
+        extract_timestamps(&msg, &times);
+        host->tx_times = times;
+    }
+#endif
+}
+
+/*
+ * Prepare the receive ring used by read_icmp_data().
+ */
+void
+init_batch_io(void)
+{
+#if defined(HAVE_MMSG)
+    memset(shard->recv_msgs, 0, sizeof(shard->recv_msgs));
+    for (int i = 0; i < RECV_BATCH_SIZE; i++) {
+        shard->recv_iovs[i].iov_base = shard->recv_buffers[i];
+        shard->recv_iovs[i].iov_len  = ICMP_REPLY_BUFFER_BYTES;
+        shard->recv_msgs[i].msg_hdr.msg_name   = &shard->recv_addrs[i];
+        shard->recv_msgs[i].msg_hdr.msg_iov    = &shard->recv_iovs[i];
+        shard->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+}
+
+/*
+ * Read pending packets from the shared socket `context`, using a single
+ * recvmmsg() to drain up to RECV_BATCH_SIZE packets where available.
+ */
+void
+read_icmp_data(void * context)
+{
+    struct probe_socket * sock = context;
+    uint64_t now = monotonic_usec();
+    struct packet_times received;
+    memset(&received, 0, sizeof(received));
+    clock_gettime(CLOCK_REALTIME, &received.software);
+
+    if (kernel_timestamps) read_tx_timestamps(sock);
+
+#if defined(HAVE_MMSG)
+    for (int i = 0; i < RECV_BATCH_SIZE; i++) {
+        shard->recv_msgs[i].msg_hdr.msg_namelen    = sizeof(shard->recv_addrs[i]);
+        shard->recv_msgs[i].msg_hdr.msg_control    = kernel_timestamps ? shard->recv_controls[i].bytes : NULL;
+        shard->recv_msgs[i].msg_hdr.msg_controllen = kernel_timestamps ? sizeof(shard->recv_controls[i].bytes) : 0;
+    }
+    int count = recvmmsg(sock->fd, shard->recv_msgs, RECV_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    if (count < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) fprintf(stderr, "WARN: Error reading ICMP data.\n");
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        struct packet_times times = received;
+        if (kernel_timestamps) extract_timestamps(&shard->recv_msgs[i].msg_hdr, &times);
+        process_icmp_packet(sock, shard->recv_buffers[i], shard->recv_msgs[i].msg_len, &shard->recv_addrs[i], now, &times);
+    }
+#else
+    union host_addr from;
+    int bytes;
+    unsigned char packet[ICMP_REPLY_BUFFER_BYTES]; /* Use char so this can be aliased later. */
+    union control_buffer control;
+    struct iovec iov = { packet, sizeof(packet) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name       = &from;
+    msg.msg_namelen    = sizeof(from);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.bytes;
+    msg.msg_controllen = sizeof(control.bytes);
+    /* Don't block: the wakeup may have been for the error queue alone. */
+    if ((bytes = recvmsg(sock->fd, &msg, MSG_DONTWAIT)) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) fprintf(stderr, "WARN: Error reading ICMP data.\n");
+        return;
+    }
+    if (kernel_timestamps) extract_timestamps(&msg, &received);
+    process_icmp_packet(sock, packet, bytes, &from, now, &received);
+#endif
+}
+
+/*
+ * Ask every shard to print its statistics.
+ */
+void
+request_shard_stats(void)
+{
+    for (int i = 0; i < shard_count; i++) {
+        atomic_store(&shards[i].stats_pending, true);
+        if (write(shards[i].wake_pipe[1], "", 1) < 0) {
+            /* The pipe is full, so the shard already has a wakeup pending. */
+        }
+    }
+}
+
+/*
+ * Parse string (IP or hostname) to an Internet address of `family`, or of
+ * either family for AF_UNSPEC.
+ *
+ * Returns false if host can't be resolved, otherwise stores the address in `result`.
+ */
+bool
+get_host_addr(const char * name, int family, union host_addr * result)
+{
+    memset(result, 0, sizeof(*result));
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+
+    int rv;
+    struct addrinfo * address;
+    if ((rv = getaddrinfo(name, NULL, &hints, &address)) != 0) return false;
+    bool found = false;
+    for (struct addrinfo * ai = address; ai && !found; ai = ai->ai_next) {
+        if ((ai->ai_family == AF_INET || ai->ai_family == AF_INET6) && ai->ai_addrlen <= sizeof(*result)) {
+            memcpy(result, ai->ai_addr, ai->ai_addrlen);
+            found = true;
+        }
+    }
+    freeaddrinfo(address);
+    return found;
+}
+
+/*
+ * Skip over a possibly compressed domain name in a DNS message.
+ *
+ * Returns NULL if the name runs past `end`.
+ */
+const unsigned char *
+skip_dns_name(const unsigned char * p, const unsigned char * end)
+{
+    while (p < end) {
+        if (*p == 0) return p + 1;
+        if ((*p & 0xC0) == 0xC0) return (p + 2 <= end) ? p + 2 : NULL;
+        p += *p + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Query DNS for the records of `type` (A or AAAA) for `name`, returning the
+ * lowest TTL among them.
+ * getaddrinfo() hides TTLs, so this separate query is made purely to learn
+ * how long the address it returned may be cached.
+ *
+ * Returns 0 if the TTL can't be determined.
+ */
+uint32_t
+query_addr_ttl(const char * name, int type, void * resolver_state)
+{
+    unsigned char answer[DNS_ANSWER_MAX_BYTES];
+#if defined(HAVE_RES_NQUERY)
+    int len = res_nquery(resolver_state, name, C_IN, type, answer, sizeof(answer));
+#else
+    int len = res_query(name, C_IN, type, answer, sizeof(answer));
+#endif
+    if (len < HFIXEDSZ || len > (int) sizeof(answer)) return 0;
+
+    const unsigned char * end = answer + len;
+    int questions = answer[4] << 8 | answer[5];
+    int answers   = answer[6] << 8 | answer[7];
+    const unsigned char * p = answer + HFIXEDSZ;
+
+    while (p && questions-- > 0) {
+        if ((p = skip_dns_name(p, end)) != NULL) p = (p + QFIXEDSZ <= end) ? p + QFIXEDSZ : NULL;
+    }
+
+    uint32_t min_ttl = 0;
+    while (p && answers-- > 0) {
+        /* Each record: name, type (2), class (2), TTL (4), data length (2), data. */
+        if ((p = skip_dns_name(p, end)) == NULL || p + 10 > end) break;
+        int record_type = p[0] << 8 | p[1];
+        int class       = p[2] << 8 | p[3];
+        uint32_t ttl    = (uint32_t) p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+        int data_len    = p[8] << 8 | p[9];
+        p += 10 + data_len;
+        if (p > end) break;
+        if (record_type == type && class == C_IN && (min_ttl == 0 || ttl < min_ttl)) min_ttl = ttl;
+    }
+    return min_ttl;
+}
+
+/*
+ * Body of each resolver thread: resolve queued names, hand the results back
+ * and wake the owning shard through its `wake_pipe`.
+ */
+void *
+resolver_thread(void * ignore)
+{
+    void * resolver_state = NULL;
+#if defined(HAVE_RES_NQUERY)
+    struct __res_state state;
+    memset(&state, 0, sizeof(state));
+    if (res_ninit(&state) == 0) resolver_state = &state;
+#endif
+
+    while (true) {
+        pthread_mutex_lock(&resolver_lock);
+        while (resolver_queue_head == NULL) pthread_cond_wait(&resolver_wakeup, &resolver_lock);
+        struct resolve_request * request = resolver_queue_head;
+        resolver_queue_head = request->next;
+        if (resolver_queue_head == NULL) resolver_queue_tail = NULL;
+        pthread_mutex_unlock(&resolver_lock);
+
+        bool found = get_host_addr(request->name, request->family, &request->addr);
+        int type = (request->addr.sa.sa_family == AF_INET6) ? T_AAAA : T_A;
+        request->ttl = 0;
+#if defined(HAVE_RES_NQUERY)
+        if (found && resolver_state) request->ttl = query_addr_ttl(request->name, type, resolver_state);
+#else
+        if (found) request->ttl = query_addr_ttl(request->name, type, NULL);
+#endif
+
+        struct shard * owner = request->shard;
+        pthread_mutex_lock(&resolver_lock);
+        request->next = owner->resolver_done;
+        owner->resolver_done = request;
+        pthread_mutex_unlock(&resolver_lock);
+
+        if (write(owner->wake_pipe[1], "", 1) < 0) {
+            /* The pipe is full, so the shard already has a wakeup pending. */
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Hand backlogged lookups to the resolver threads while fewer than this
+ * shard's share of `max_lookups` are in flight. Each lookup's timeout starts
+ * once dispatched.
+ */
+void
+dispatch_lookups(void)
+{
+    while (shard->lookup_backlog_head && shard->lookups_in_flight < shard->lookup_limit) {
+        struct resolve_request * request = shard->lookup_backlog_head;
+        shard->lookup_backlog_head = request->next;
+        if (shard->lookup_backlog_head == NULL) shard->lookup_backlog_tail = NULL;
+
+        /* The host was removed before its lookup got a resolver thread. */
+        if (request->host == NULL) {
+            free(request->name);
+            free(request);
+            continue;
+        }
+
+        timer_schedule(&request->host->resolve_timer, monotonic_usec() + lookup_timeout);
+
+        request->next = NULL;
+        pthread_mutex_lock(&resolver_lock);
+        if (resolver_queue_tail) {
+            resolver_queue_tail->next = request;
+        } else {
+            resolver_queue_head = request;
+        }
+        resolver_queue_tail = request;
+        pthread_cond_signal(&resolver_wakeup);
+        pthread_mutex_unlock(&resolver_lock);
+        shard->lookups_in_flight++;
+    }
+}
+
+/*
+ * Queue a background lookup of the name of `host`.
+ */
+void
+start_lookup(struct host_entry * host)
+{
+    if (host->pending_lookup) return;
+
+    struct resolve_request * request = calloc(1, sizeof(struct resolve_request));
+    if (request == NULL || (request->name = strdup(host->config->name)) == NULL) {
+        fprintf(stderr, "WARN: Unable to queue lookup of %s. Retrying later.\n", host->config->name);
+        free(request);
+        timer_schedule(&host->resolve_timer, monotonic_usec() + LOOKUP_RETRY_INTERVAL);
+        return;
+    }
+    request->host = host;
+    request->shard = shard;
+    request->family = host->config->family;
+    host->pending_lookup = request;
+
+    if (shard->lookup_backlog_tail) {
+        shard->lookup_backlog_tail->next = request;
+    } else {
+        shard->lookup_backlog_head = request;
+    }
+    shard->lookup_backlog_tail = request;
+
+    dispatch_lookups();
+}
+
+/*
+ * Record a newly resolved address for `host`, starting to ping it if this is
+ * its first address. Runs on the owning shard between pings, so no probe ever
+ * sees a half-updated destination.
+ */
+void
+set_host_addr(struct host_entry * host, const union host_addr * addr)
+{
+    if (host->resolved && host_addr_equal(&host->dest, addr)) return;
+
+    char old_addr[INET6_ADDRSTRLEN], new_addr[INET6_ADDRSTRLEN];
+    host_addr_string(addr, new_addr, sizeof(new_addr));
+
+    if (host->resolved) {
+        host_addr_string(&host->dest, old_addr, sizeof(old_addr));
+        host_hash_remove(host);
+        host->dest = *addr;
+        build_probe_template(host);
+        if (verbose) printf("INFO: Address of %s changed from %s to %s.\n", host->config->name, old_addr, new_addr);
+
+        /* The new address may take a different path, so search for its MTU afresh. */
+        if (host->config->pmtu_discovery) {
+            host->pmtu_low  = 0;
+            host->pmtu_size = 0;
+            host->path_mtu  = 0;
+            timer_schedule(&host->pmtu_timer, monotonic_usec() + host->ping_interval);
+        }
+    } else {
+        host->dest = *addr;
+    }
+    host_hash_insert(host);
+
+    if (!host->resolved) {
+        host->resolved = true;
+        if (verbose) printf("INFO: Resolved %s to %s.\n", host->config->name, new_addr);
+        activate_host(host, monotonic_usec());
+    }
+}
+
+/*
+ * Called by the scheduler when a lookup of `host` times out, the delay
+ * before retrying a failed lookup has passed, or its address's TTL expired. A timed out lookup is
+ * abandoned, though it keeps its resolver thread until getaddrinfo() returns.
+ */
+void
+lookup_timer_fired(void * context)
+{
+    struct host_entry * host = context;
+    if (host->pending_lookup) {
+        fprintf(stderr, "WARN: Timed out resolving %s. Retrying in background.\n", host->config->name);
+        host->pending_lookup->host = NULL;
+        host->pending_lookup = NULL;
+        timer_schedule(&host->resolve_timer, monotonic_usec() + LOOKUP_RETRY_INTERVAL);
+    } else {
+        start_lookup(host);
+    }
+}
+
+/*
+ * Wait while the main thread reloads the configuration, changing this
+ * shard's hosts, timers and sockets meanwhile. Must be called from the event
+ * loop with no host in hand.
+ */
+void
+park_shard(void)
+{
+    pthread_mutex_lock(&park_lock);
+    parked_shards++;
+    pthread_cond_broadcast(&park_cond);
+    while (world_stopped) pthread_cond_wait(&park_cond, &park_lock);
+    parked_shards--;
+    pthread_mutex_unlock(&park_lock);
+}
+
+/*
+ * Handle wakeups of this shard: statistics requests, reloads, and lookups
+ * finished by the resolver threads.
+ */
+void
+read_wakeups(void * ignore) /* Dummy parameter since this function registers as an event handler. */
+{
+    char buf[64];
+    while (read(shard->wake_pipe[0], buf, sizeof(buf)) > 0);
+
+    if (atomic_exchange(&shard->stats_pending, false)) print_stats();
+    if (atomic_exchange(&shard->park_pending, false)) park_shard();
+
+    pthread_mutex_lock(&resolver_lock);
+    struct resolve_request * request = shard->resolver_done;
+    shard->resolver_done = NULL;
+    pthread_mutex_unlock(&resolver_lock);
+
+    while (request) {
+        struct resolve_request * next = request->next;
+        struct host_entry * host = request->host;
+        shard->lookups_in_flight--;
+
+        if (host) {
+            host->pending_lookup = NULL;
+            if (request->addr.sa.sa_family != AF_UNSPEC) {
+                set_host_addr(host, &request->addr);
+                uint64_t ttl = request->ttl ? (uint64_t) request->ttl * USEC_PER_SEC : DEFAULT_ADDR_TTL;
+                if (ttl < MIN_ADDR_TTL) ttl = MIN_ADDR_TTL;
+                if (ttl > MAX_ADDR_TTL) ttl = MAX_ADDR_TTL;
+                timer_schedule(&host->resolve_timer, monotonic_usec() + ttl);
+            } else {
+                /* A host which resolved before keeps pinging its last known address meanwhile. */
+                fprintf(stderr, "WARN: Unable to resolve %s. Retrying in background.\n", host->config->name);
+                timer_schedule(&host->resolve_timer, monotonic_usec() + LOOKUP_RETRY_INTERVAL);
+            }
+        }
+
+        free(request->name);
+        free(request);
+        request = next;
+    }
+
+    dispatch_lookups();
+}
+
+/*
+ * Create this shard's wakeup pipe and register it. Must be called after
+ * event_init().
+ */
+void
+init_wakeups(void)
+{
+    if (pipe(shard->wake_pipe) < 0) {
+        fprintf(stderr, "ERROR: Unable to create wakeup pipe.\n");
+        exit(EXIT_FAILURE);
+    }
+    set_fd_flags(shard->wake_pipe[0], true);
+    set_fd_flags(shard->wake_pipe[1], true);
+    event_register(shard->wake_pipe[0], read_wakeups, NULL);
+}
+
+/*
+ * Start the resolver threads, enough for every shard's share of lookups.
+ * Signals are blocked in them so that every signal interrupts the main
+ * thread's event loop.
+ */
+void
+init_resolver(void)
+{
+    int threads = (max_lookups > shard_count) ? max_lookups : shard_count;
+
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, resolver_thread, NULL) != 0) {
+            fprintf(stderr, "ERROR: Unable to start resolver thread.\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+}
+
+/*
+ * Parse a duration such as "2", "0.25" or "250ms" into microseconds. Bare
+ * numbers and an "s" suffix are seconds, an "ms" suffix is milliseconds.
+ *
+ * Returns 0 if the string isn't a valid, positive duration.
+ */
+uint64_t
+parse_duration(const char * str)
+{
+    if (str == NULL) return 0;
+
+    char * suffix;
+    errno = 0;
+    double value = strtod(str, &suffix);
+    if (errno || suffix == str || value <= 0) return 0;
+
+    while (*suffix == ' ') suffix++;
+    if (strcmp(suffix, "ms") == 0) {
+        value *= USEC_PER_MSEC;
+    } else if (*suffix == '\0' || strcmp(suffix, "s") == 0) {
+        value *= USEC_PER_SEC;
+    } else {
+        return 0;
+    }
+
+    if (value >= (double) UINT64_MAX) return 0;
+    return (uint64_t) value;
+}
+
+/*
+ * Free the strings of `count` host configs at `configs`.
+ */
+void
+free_host_configs(struct host_config * configs, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        free(configs[i].label);
+        free(configs[i].name);
+        free(configs[i].up_cmd);
+        free(configs[i].down_cmd);
+        free(configs[i].parents);
+    }
+}
+
+/*
+ * Return a copy of `str`, or NULL if `str` is NULL.
+ */
+char *
+strdup_or_null(const char * str)
+{
+    return str ? strdup(str) : NULL;
+}
+
+/*
+ * Parse a configuration file using the `iniparser` library, appending its
+ * hosts to the `count` entries of `*table` and `*configs`. Configs are linked
+ * to their entries only once the arrays stop moving.
+ * See `icmpmonitor.ini` and `README.md` for examples and reference.
+ *
+ * Returns false, having printed why, if the file has any problems. The
+ * arrays then hold every host appended so far, some partially parsed.
+ */
+bool
+parse_config(const char * conf_file, struct host_entry ** table, struct host_config ** configs, size_t * count)
+{
+    dictionary * conf = iniparser_load(conf_file);
+    if (conf == NULL) {
+        fprintf(stderr, "ERROR: Unable to parse configuration file %s.\n", conf_file);
+        return false;
+    }
+
+    int host_count = iniparser_getnsec(conf);
+    if (host_count < 1 ) {
+        fprintf(stderr, "ERROR: Unable to determine number of hosts in configuration file.\n");
+        iniparser_freedict(conf);
+        return false;
+    }
+
+    /* Hosts from each config file given are appended to the table. */
+    size_t first = *count;
+    struct host_entry *  grown_table   = realloc(*table, (first + host_count) * sizeof(struct host_entry));
+    if (grown_table) *table = grown_table;
+    struct host_config * grown_configs = realloc(*configs, (first + host_count) * sizeof(struct host_config));
+    if (grown_configs) *configs = grown_configs;
+    if (grown_table == NULL || grown_configs == NULL) {
+        fprintf(stderr, "ERROR: Unable to allocate host table.\n");
+        iniparser_freedict(conf);
+        return false;
+    }
+    memset(&(*table)[first], 0, host_count * sizeof(struct host_entry));
+    memset(&(*configs)[first], 0, host_count * sizeof(struct host_config));
+    *count += host_count;
+
+    bool ok = true;
+    int section_pos = 0;
+    for (int i=0; ok && i < host_count; i++) {
+        const char * section = iniparser_nextsec(conf, &section_pos);
+
+        /* Allocate a reusable buffer large enough to hold the full 'section:key' string. */
+        int section_len = strlen(section);
+        char * key_buf = malloc(section_len + 1 + MAX_CONF_KEY_LEN + 1); /* +1 for ':' and '\0' */
+        if (key_buf == NULL) {
+            fprintf(stderr, "ERROR: Unable to allocate memory parsing section %s.\n", section);
+            ok = false;
+            break;
+        }
+        strcpy(key_buf, section);
+        key_buf[section_len++] = ':';
+
+        struct host_entry *  cur_host   = &(*table)[first + i];
+        struct host_config * cur_config = &(*configs)[first + i];
+
+        /* Reloads match hosts to their new configs by section label. */
+        cur_config->label = strdup(section);
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "host", MAX_CONF_KEY_LEN);
+        cur_config->name = strdup_or_null(iniparser_getstring(conf, key_buf, NULL));
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "interval", MAX_CONF_KEY_LEN);
+        cur_host->ping_interval = parse_duration(iniparser_getstring(conf, key_buf, NULL));
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "max_delay", MAX_CONF_KEY_LEN);
+        cur_host->max_delay = parse_duration(iniparser_getstring(conf, key_buf, NULL));
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "up_cmd", MAX_CONF_KEY_LEN);
+        cur_config->up_cmd = strdup_or_null(iniparser_getstring(conf, key_buf, NULL));
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "down_cmd", MAX_CONF_KEY_LEN);
+        cur_config->down_cmd = strdup_or_null(iniparser_getstring(conf, key_buf, NULL));
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "start_condition", MAX_CONF_KEY_LEN);
+        const char * value = iniparser_getstring(conf, key_buf, NULL);
+        if (value && strcmp(value, "auto") == 0) {
+            /* Settled from the state file, or else by the first ping. */
+            cur_host->state_unknown = true;
+            cur_host->sweep_pending = true;
+        } else if (value) {
+            cur_host->host_up = *value == 'u' ? true : false;
+        }
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "family", MAX_CONF_KEY_LEN);
+        value = iniparser_getstring(conf, key_buf, "ipv4");
+        if (strcmp(value, "ipv4") == 0) {
+            cur_config->family = AF_INET;
+        } else if (strcmp(value, "ipv6") == 0) {
+            cur_config->family = AF_INET6;
+        } else if (strcmp(value, "any") == 0) {
+            cur_config->family = AF_UNSPEC;
+        } else {
+            fprintf(stderr, "ERROR: Unknown family %s in section %s.\n", value, section);
+            ok = false;
+        }
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "payload_size", MAX_CONF_KEY_LEN);
+        int payload_size = iniparser_getint(conf, key_buf, ICMP_ECHO_DATA_BYTES);
+        if (payload_size < (int) ICMP_ECHO_DATA_BYTES || payload_size > MAX_PAYLOAD_BYTES) {
+            fprintf(stderr, "ERROR: payload_size in section %s must be between %d and %d bytes.\n",
+                    section, (int) ICMP_ECHO_DATA_BYTES, MAX_PAYLOAD_BYTES);
+            ok = false;
+        }
+        cur_host->probe_bytes = ICMP_ECHO_HEADER_BYTES + payload_size;
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "dont_fragment", MAX_CONF_KEY_LEN);
+        cur_host->dont_fragment = iniparser_getboolean(conf, key_buf, false);
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "pmtu_discovery", MAX_CONF_KEY_LEN);
+        cur_config->pmtu_discovery = iniparser_getboolean(conf, key_buf, false);
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "pmtu_max", MAX_CONF_KEY_LEN);
+        int pmtu_max = iniparser_getint(conf, key_buf, DEFAULT_PMTU_MAX);
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "pmtu_min", MAX_CONF_KEY_LEN);
+        int pmtu_min = iniparser_getint(conf, key_buf, 0); /* By default drops are only logged. */
+
+        if (pmtu_max < PMTU_MIN_IPV4 || pmtu_max > IP_MAXPACKET || pmtu_min < 0 || pmtu_min > pmtu_max) {
+            fprintf(stderr, "ERROR: pmtu_max in section %s must be between %d and %d bytes, and pmtu_min no larger.\n",
+                    section, PMTU_MIN_IPV4, IP_MAXPACKET);
+            ok = false;
+        }
+        cur_config->pmtu_max = pmtu_max;
+        cur_config->pmtu_min = pmtu_min;
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "loss_window", MAX_CONF_KEY_LEN);
+        int loss_window = iniparser_getint(conf, key_buf, 0);
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "down_after", MAX_CONF_KEY_LEN);
+        int down_after = iniparser_getint(conf, key_buf, loss_window);
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "up_after", MAX_CONF_KEY_LEN);
+        int up_after = iniparser_getint(conf, key_buf, 1);
+
+        if (loss_window < 0 || loss_window > MAX_LOSS_WINDOW || (loss_window
+            && (down_after < 1 || down_after > loss_window || up_after < 1 || up_after > MAX_LOSS_WINDOW))) {
+            fprintf(stderr, "ERROR: loss_window in section %s must be between 0 and %d pings, down_after between 1 and loss_window, and up_after between 1 and %d.\n",
+                    section, MAX_LOSS_WINDOW, MAX_LOSS_WINDOW);
+            ok = false;
+        }
+        if (loss_window) {
+            cur_host->loss_window = loss_window;
+            cur_host->down_after  = down_after;
+            cur_host->up_after    = up_after;
+        }
+
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "retry_down_cmd", MAX_CONF_KEY_LEN);
+        cur_host->retry_down_cmd = iniparser_getboolean(conf, key_buf, retry_down_cmd);
 
-#include "iniparser/iniparser.h"
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "max_down_interval", MAX_CONF_KEY_LEN);
+        value = iniparser_getstring(conf, key_buf, NULL);
+        if (value && (cur_host->max_down_interval = parse_duration(value)) < cur_host->ping_interval) {
+            fprintf(stderr, "ERROR: max_down_interval in section %s must be a time no shorter than interval.\n", section);
+            ok = false;
+        }
 
-#define VERSION 2
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "confirm_interval", MAX_CONF_KEY_LEN);
+        value = iniparser_getstring(conf, key_buf, NULL);
+        if (value && ((cur_host->confirm_interval = parse_duration(value)) == 0 || cur_host->confirm_interval >= cur_host->ping_interval)) {
+            fprintf(stderr, "ERROR: confirm_interval in section %s must be a time shorter than interval.\n", section);
+            ok = false;
+        }
 
-/* ICMP header contains: type, code, checksum, identifier and sequence number. */
-#define ICMP_ECHO_HEADER_BYTES  8
-#define ICMP_ECHO_DATA_BYTES    sizeof(struct timeval)
-#define ICMP_ECHO_PACKET_BYTES  ICMP_ECHO_HEADER_BYTES + ICMP_ECHO_DATA_BYTES
-#define IP_PACKET_MAX_BYTES     65535
+        /* Section labels are lowercased by iniparser, so parents are too. Checked by check_parents(). */
+        key_buf[section_len] = '\0';
+        strncat(key_buf, "parent", MAX_CONF_KEY_LEN);
+        cur_config->parents = strdup_or_null(iniparser_getstring(conf, key_buf, NULL));
+        for (char * p = cur_config->parents; p && *p; p++) *p = tolower((unsigned char) *p);
 
-/* Minimum time in seconds between pings. If this value is increased above the */
-/* `ping_interval` for a given host, some pings to that host may not be sent.  */
-#define TIMER_RESOLUTION        1
+#if !defined(HAVE_DONT_FRAGMENT)
+        if (cur_host->dont_fragment || cur_config->pmtu_discovery) {
+            fprintf(stderr, "ERROR: Setting the don't fragment bit is not supported on this platform.\n");
+            ok = false;
+        }
+#endif
 
-/* Must be larger than the length of the longest configuration key (not value). */
-/* For example: MAX_CONF_KEY_LEN > strlen("start_condition")                    */
-#define MAX_CONF_KEY_LEN 	20
+        if (cur_config->label == NULL || cur_config->name == NULL || cur_config->up_cmd == NULL
+            || cur_config->down_cmd == NULL || cur_host->ping_interval == 0 || cur_host->max_delay == 0) {
+            fprintf(stderr, "ERROR: Problems parsing section %s.\n", section);
+            ok = false;
+        }
 
-/* One struct per host as listed in the config file. */
-struct host_entry {
-    /* From the config file */
-    char * name;
-    int    ping_interval;
-    int    max_delay;
-    char * up_cmd;
-    char * down_cmd;
+        cur_host->seq = 0;
 
-    /* Calculated values */
-    int                socket;
-    struct timeval     last_ping_received;
-    struct timeval     last_ping_sent;
-    bool               host_up;
-    struct sockaddr_in dest;
+        free(key_buf);
+    }
+    iniparser_freedict(conf);
+    return ok;
+}
 
-    /* Linked list */
-    struct host_entry * next;
-};
+/*
+ * Return a dictionary mapping the section label of each of the `count`
+ * `configs` to its index, or NULL if memory runs out. With a label repeated
+ * across files, the first entry is indexed.
+ */
+dictionary *
+index_labels(const struct host_config * configs, size_t count)
+{
+    dictionary * labels = dictionary_new(count);
+    for (size_t j = 0; labels && j < count; j++) {
+        char index[32];
+        snprintf(index, sizeof(index), "%zu", j);
+        if (dictionary_get(labels, configs[j].label, NULL) == NULL && dictionary_set(labels, configs[j].label, index) != 0) {
+            dictionary_del(labels);
+            labels = NULL;
+        }
+    }
+    return labels;
+}
 
-/* Globals */
-    /* Since the program is based around signals, a linked list of hosts is maintained here. */
-    struct host_entry * first_host_in_list = NULL;
-    /* Set by command line flags. */
-    bool                verbose            = false;
-    bool                retry_down_cmd     = false;
+/*
+ * Copy the next label from the comma separated `*list` into `buf`, trimmed of
+ * whitespace, advancing `*list` past it. Returns false at the end of the list.
+ */
+bool
+next_parent(const char ** list, char * buf, size_t len)
+{
+    const char * start = *list;
+    while (*start == ',' || isspace((unsigned char) *start)) start++;
+    if (*start == '\0') return false;
+
+    const char * end = strchr(start, ',');
+    if (end == NULL) end = start + strlen(start);
+    *list = end;
+    while (end > start && isspace((unsigned char) end[-1])) end--;
+
+    size_t bytes = end - start;
+    if (bytes >= len) bytes = len - 1;
+    memcpy(buf, start, bytes);
+    buf[bytes] = '\0';
+    return true;
+}
 
 /*
- * Generate an Internet Checksum per RFC 1071.
- *
- * This is not a general purpose implementation of RFC 1071.  Since we only
- * send ICMP echo packets, we assume 'data' will contain a specific number of
- * bytes.
+ * Depth first walk from host `j` up through its parents for check_parents().
+ * `marks` holds 1 for hosts on the current path and 2 for those cleared.
  */
-uint16_t
-checksum(const uint16_t * data)
+bool
+visit_parents(const struct host_config * configs, dictionary * labels, size_t j, unsigned char * marks)
 {
-    uint32_t accumulator = 0;
-    for (size_t i = 0; i < ICMP_ECHO_PACKET_BYTES / 2; i++) {
-        accumulator += ntohs(data[i]);
-        if (accumulator > 0xffff) accumulator -= 0xffff;
+    if (marks[j] == 2) return true;
+    if (marks[j] == 1) {
+        fprintf(stderr, "ERROR: Section %s is among its own parents.\n", configs[j].label);
+        return false;
     }
-    return htons(~accumulator);
+    marks[j] = 1;
+
+    const char * list = configs[j].parents ? configs[j].parents : "";
+    char label[MAX_PARENT_LABEL_BYTES];
+    while (next_parent(&list, label, sizeof(label))) {
+        const char * index = dictionary_get(labels, label, NULL);
+        if (index == NULL) {
+            fprintf(stderr, "ERROR: Unknown parent %s in section %s.\n", label, configs[j].label);
+            return false;
+        }
+        if (!visit_parents(configs, labels, strtoul(index, NULL, 10), marks)) return false;
+    }
+    marks[j] = 2;
+    return true;
 }
 
 /*
- * Calculate difference (a-b) between two timeval structs.
+ * Check that every parent named by the `count` `configs` is the label of one
+ * of them, and that the parents form no loop. `labels` maps each label to its
+ * index. Returns false, having printed why, otherwise.
  */
-void
-timeval_diff(struct timeval * a, const struct timeval * b)
+bool
+check_parents(const struct host_config * configs, size_t count, dictionary * labels)
 {
-    if (a->tv_usec < b->tv_usec) {
-        a->tv_sec--;
-        a->tv_usec += 1000000;
+    unsigned char * marks = calloc(count, 1);
+    if (marks == NULL) {
+        fprintf(stderr, "ERROR: Unable to allocate memory checking parents.\n");
+        return false;
     }
-    a->tv_usec -= b->tv_usec;
-    a->tv_sec -= b->tv_sec;
+    bool ok = true;
+    for (size_t j = 0; ok && j < count; j++) ok = visit_parents(configs, labels, j, marks);
+    free(marks);
+    return ok;
 }
 
 /*
- * This function iterates over the list of hosts, pinging any which are due.
+ * Point every live host at the entries of the parents named by its config,
+ * as checked by check_parents(). Called before the shards start and after
+ * each reload, with every other shard stopped.
  */
 void
-pinger(int ignore) /* Dummy parameter since this function registers as a signal handler. */
+link_parents(void)
 {
-    assert(first_host_in_list);
+    size_t live = 0;
+    for (int i = 0; i < shard_count; i++) live += shards[i].host_count;
+    struct host_entry ** hosts  = malloc((live ? live : 1) * sizeof(*hosts));
+    dictionary *         labels = dictionary_new(live);
 
-    struct icmp * icmp_packet;
-    struct host_entry * host = first_host_in_list;
-    unsigned char packet[IP_PACKET_MAX_BYTES]; /* Use char so this can be aliased later. */
+    /* Index the live hosts by label, dropping every link should memory run out. */
+    size_t n = 0;
+    bool ok = (hosts != NULL && labels != NULL);
+    for (int i = 0; i < shard_count; i++) {
+        struct shard * s = &shards[i];
+        for (size_t r = 0; r < s->range_count; r++) {
+            struct host_entry * host = s->ranges[r].hosts;
+            for (size_t k = 0; k < s->ranges[r].count; k++, host++) {
+                if (host->removed) continue;
+                free(host->parents);
+                host->parents = NULL;
+                host->parent_count = 0;
+                if (!ok || n == live) continue;
 
-    while (host) {
-        struct timeval elapsed_time;
-        gettimeofday(&elapsed_time, NULL);
-        timeval_diff(&elapsed_time, &host->last_ping_received);
-
-        if ((elapsed_time.tv_sec > host->max_delay) && (host->host_up || retry_down_cmd)) {
-            if (verbose) printf("INFO: Host %s stopped responding. Executing DOWN command.\n", host->name);
-            host->host_up = false;
-            if (!fork()) {
-                int sys_ret = system(host->down_cmd);
-                exit(sys_ret);
+                char index[32];
+                snprintf(index, sizeof(index), "%zu", n);
+                const char * label = host->config->label;
+                if (dictionary_get(labels, label, NULL) == NULL && dictionary_set(labels, label, index) != 0) ok = false;
+                hosts[n++] = host;
             }
         }
+    }
+
+    for (size_t h = 0; ok && h < n; h++) {
+        struct host_entry * host = hosts[h];
+        const char * list = host->config->parents;
+        if (list == NULL) continue;
+
+        char label[MAX_PARENT_LABEL_BYTES];
+        size_t count = 0;
+        for (const char * p = list; next_parent(&p, label, sizeof(label)); ) count++;
+        if (count == 0) continue;
+        if ((host->parents = malloc(count * sizeof(*host->parents))) == NULL) {
+            ok = false;
+            break;
+        }
+        while (next_parent(&list, label, sizeof(label))) {
+            const char * index = dictionary_get(labels, label, NULL);
+            if (index) host->parents[host->parent_count++] = hosts[strtoul(index, NULL, 10)];
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "WARN: Unable to allocate memory linking parents. Ignoring the parent option.\n");
+        for (size_t h = 0; h < n; h++) {
+            free(hosts[h]->parents);
+            hosts[h]->parents = NULL;
+            hosts[h]->parent_count = 0;
+        }
+    }
 
-        if (elapsed_time.tv_sec > host->ping_interval) {
-            if (verbose) printf("INFO: Sending ICMP packet to %s.\n", host->name);
+    if (labels) dictionary_del(labels);
+    free(hosts);
+}
 
-            icmp_packet = (struct icmp *) packet;
-            icmp_packet->icmp_type  = ICMP_ECHO;
-            icmp_packet->icmp_code  = 0;
-            icmp_packet->icmp_cksum = 0;
-            icmp_packet->icmp_seq   = host->socket;
-            icmp_packet->icmp_id    = getpid() & 0xFFFF;
+/*
+ * Stop monitoring `host`. Its table slot is left unused so that no other
+ * host moves. Must be called from the owning shard.
+ */
+void
+remove_host(struct host_entry * host)
+{
+    timer_cancel(&host->send_timer);
+    timer_cancel(&host->deadline_timer);
+    timer_cancel(&host->resolve_timer);
+    timer_cancel(&host->pmtu_timer);
+    if (host->pending_lookup) {
+        host->pending_lookup->host = NULL;
+        host->pending_lookup = NULL;
+    }
+    if (host->resolved) host_hash_remove(host);
+    host->resolved = false;
+    host->removed = true;
+    shard->host_count--;
+}
 
-            /* Write a timestamp struct in the packet's data segment for use in calculating travel times. */
-            gettimeofday((struct timeval *) &packet[ICMP_ECHO_HEADER_BYTES], NULL);
+/*
+ * Open the socket shared by hosts of `sock->family`, using ICMP protocol
+ * number `protocol`.
+ */
+void
+open_probe_socket(struct probe_socket * sock, int protocol)
+{
+    bool ipv6 = (sock->family == AF_INET6);
+    sock->datagram = unprivileged;
 
-            icmp_packet->icmp_cksum = checksum((uint16_t *) packet);
+    if ((sock->fd = socket(sock->family, sock->datagram ? SOCK_DGRAM : SOCK_RAW, protocol)) < 0) {
+        fprintf(stderr, "ERROR: Failed creating %s socket.\n", ipv6 ? "ICMPv6" : "ICMP");
+#if defined(__linux__)
+        if (sock->datagram) fprintf(stderr, "ERROR: Is our group permitted by sysctl net.ipv4.ping_group_range?\n");
+#endif
+        exit(EXIT_FAILURE);
+    }
+    /* Up/down commands must not inherit the socket. */
+    set_fd_flags(sock->fd, false);
 
-            size_t bytes_sent = sendto(host->socket, packet, ICMP_ECHO_PACKET_BYTES, 0,
-                                       (const struct sockaddr *) &host->dest,
-                                       sizeof(struct sockaddr));
+    /* Linux datagram sockets strip the IP header and fill in the echo identifier and checksum. */
+#if defined(__linux__)
+    sock->kernel_echo = sock->datagram;
+    sock->ip_header   = !ipv6 && !sock->datagram;
+#else
+    sock->kernel_echo = false;
+    sock->ip_header   = !ipv6;
+#endif
 
-            if (bytes_sent == ICMP_ECHO_PACKET_BYTES) {
-                gettimeofday(&host->last_ping_sent, NULL);
-            } else {
-                fprintf(stderr, "WARN: Failed sending ICMP packet to %s.\n", host->name);
-            }
+    /* Have the kernel discard everything except echo replies before it reaches us. */
+    if (ipv6 && !sock->datagram) {
+        struct icmp6_filter filter;
+        ICMP6_FILTER_SETBLOCKALL(&filter);
+        ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+        if (setsockopt(sock->fd, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter)) < 0) {
+            fprintf(stderr, "WARN: Unable to install ICMPv6 filter.\n");
         }
-        host = host->next;
     }
 
-    signal(SIGALRM, pinger);
-    alarm(TIMER_RESOLUTION);
+    /* Fragmentation is allowed except for probes which ask otherwise. */
+    sock->dont_fragment = true;
+    set_dont_fragment(sock, false);
+
+    if (kernel_timestamps) enable_kernel_timestamps(sock);
 }
 
-void
-read_icmp_data(struct host_entry * host)
+/*
+ * Set up the timers and probe buffers of `host`, which must not move
+ * afterwards, and take its address from the config if given literally.
+ *
+ * Returns true if the host may need the ICMPv6 socket.
+ */
+bool
+prepare_host(struct host_entry * host)
 {
-    struct timeval now;
-    gettimeofday(&now, NULL);
+    set_host_up(host, host->host_up);
+    timer_init(&host->send_timer, pinger, host);
+    timer_init(&host->deadline_timer, check_deadline, host);
+    timer_init(&host->resolve_timer, lookup_timer_fired, host);
+    timer_init(&host->pmtu_timer, pmtu_timer_fired, host);
 
-    struct sockaddr_in from;
-    socklen_t fromlen = sizeof(from);
-    int bytes;
-    unsigned char packet[IP_PACKET_MAX_BYTES]; /* Use char so this can be aliased later. */
-    if ((bytes = recvfrom(host->socket, packet, sizeof(packet), 0, (struct sockaddr *) &from, &fromlen)) < 0) {
-        if (errno != EINTR) fprintf(stderr, "WARN: Error reading ICMP data from %s.\n", host->name);
-        return;
+    /* Probe buffers are sized once, from the config. */
+    struct host_config * config = host->config;
+    host->probe = calloc(1, host->probe_bytes);
+    if (config->pmtu_discovery) {
+        size_t pmtu_bytes = config->pmtu_max - IPV4_HEADER_BYTES;
+        if ((host->pmtu_packet = calloc(1, pmtu_bytes)) != NULL) {
+            fill_echo_padding(host->pmtu_packet, ICMP_ECHO_PACKET_BYTES, pmtu_bytes);
+        }
+    }
+    if (host->probe == NULL || (config->pmtu_discovery && host->pmtu_packet == NULL)) {
+        fprintf(stderr, "ERROR: Unable to allocate probe buffers for %s.\n", config->name);
+        exit(EXIT_FAILURE);
     }
 
-    struct ip * ip     = (struct ip *) packet;
-    int iphdrlen       = ip->ip_hl << 2;
-    struct icmp * icmp = (struct icmp *) (packet + iphdrlen);
-
-    if (bytes < iphdrlen + ICMP_MINLEN) {
-        fprintf(stderr, "WARN: Received short packet from %s.\n", host->name);
-        return;
+    bzero(&host->dest, sizeof(host->dest));
+    if (inet_pton(AF_INET, config->name, &host->dest.v4.sin_addr) == 1) {
+        host->dest.v4.sin_family = AF_INET;
+        host->resolved = true;
+    } else if (inet_pton(AF_INET6, config->name, &host->dest.v6.sin6_addr) == 1) {
+        host->dest.v6.sin6_family = AF_INET6;
+        host->resolved = true;
+    } else {
+        host->resolved = false;
     }
+    return host->resolved ? host->dest.sa.sa_family == AF_INET6 : config->family != AF_INET;
+}
 
-    if (icmp->icmp_type == ICMP_ECHOREPLY && icmp->icmp_id == (getpid() & 0xFFFF) && icmp->icmp_seq == host->socket) {
-        memcpy(&host->last_ping_received, &now, sizeof(now));
-        if (verbose) printf("INFO: Got ICMP reply from %s.\n", host->name);
-        if (!host->host_up) {
-            if (verbose) printf("INFO: Host %s started responding. Executing UP command.\n", host->name);
-            host->host_up = true;
-            if (!fork()) {
-                int sys_ret = system(host->up_cmd);
-                exit(sys_ret);
-            }
+/*
+ * Stop every shard but the calling first one, returning once all are parked.
+ */
+void
+stop_shards(void)
+{
+    pthread_mutex_lock(&park_lock);
+    world_stopped = true;
+    pthread_mutex_unlock(&park_lock);
+
+    for (int i = 1; i < shard_count; i++) {
+        atomic_store(&shards[i].park_pending, true);
+        if (write(shards[i].wake_pipe[1], "", 1) < 0) {
+            /* The pipe is full, so the shard already has a wakeup pending. */
         }
-    } else {
-        /* The packet isn't what we expected. Ignore it and move on. */
     }
+
+    pthread_mutex_lock(&park_lock);
+    while (parked_shards < shard_count - 1) pthread_cond_wait(&park_cond, &park_lock);
+    pthread_mutex_unlock(&park_lock);
 }
 
 /*
- * This function contains the main program loop, listening for replies to pings
- * sent from the signal-driven pinger().
+ * Let the shards parked by stop_shards() run again.
  */
 void
-get_response(void)
+resume_shards(void)
 {
-    while (true) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-
-        assert(first_host_in_list);
-        struct host_entry * host = first_host_in_list;
-
-        int max_fd = -1;
-        while (host) {
-            if (host->socket > max_fd) max_fd = host->socket;
-            FD_SET(host->socket, &rfds);
-            host = host->next;
-        }
-
-        int retval;
-        if ((retval = select(max_fd+1, &rfds, NULL, NULL, NULL)) > 0) {
-            assert(first_host_in_list);
-            host = first_host_in_list;
-            while (host) {
-                if (FD_ISSET(host->socket, &rfds)) read_icmp_data(host);
-                host = host->next;
+    pthread_mutex_lock(&park_lock);
+    world_stopped = false;
+    pthread_cond_broadcast(&park_cond);
+    pthread_mutex_unlock(&park_lock);
+}
+
+/*
+ * Save the state of every host, with the other shards stopped, and exit.
+ * Triggered by SIGTERM or SIGINT when a state file is in use.
+ */
+void
+exit_saving_state(void)
+{
+    stop_shards();
+    uint64_t now = monotonic_usec(), wall = realtime_usec();
+    for (int i = 0; i < shard_count; i++) {
+        struct shard * s = &shards[i];
+        for (size_t r = 0; r < s->range_count; r++) {
+            struct host_entry * host = s->ranges[r].hosts;
+            for (size_t k = 0; k < s->ranges[r].count; k++, host++) {
+                if (!host->removed) save_host_state(host, now, wall);
             }
-        } else {
-            /* An error or interruption occurred.                    */
-            /* We can't do anything about it, so loop and try again. */
         }
     }
+    if (state_map && msync(state_map, state_map_bytes, MS_SYNC) < 0) {
+        fprintf(stderr, "WARN: Unable to write state file %s.\n", state_file);
+    }
+    exit(EXIT_SUCCESS);
 }
 
 /*
- * Parse a configuration file using the `iniparser` library.
- * See `icmpmonitor.ini` and `README.md` for examples and reference.
+ * Return true if `host` is monitored exactly as the freshly parsed `entry`
+ * and `config` ask, so it can keep running as it is.
+ */
+bool
+host_unchanged(const struct host_entry * host, const struct host_entry * entry, const struct host_config * config)
+{
+    const struct host_config * old = host->config;
+    return strcmp(old->name, config->name) == 0
+        && strcmp(old->up_cmd, config->up_cmd) == 0
+        && strcmp(old->down_cmd, config->down_cmd) == 0
+        && old->family         == config->family
+        && old->pmtu_discovery == config->pmtu_discovery
+        && old->pmtu_max       == config->pmtu_max
+        && old->pmtu_min       == config->pmtu_min
+        && host->ping_interval == entry->ping_interval
+        && host->max_delay     == entry->max_delay
+        && host->probe_bytes   == entry->probe_bytes
+        && host->dont_fragment == entry->dont_fragment
+        && host->loss_window   == entry->loss_window
+        && host->down_after    == entry->down_after
+        && host->up_after      == entry->up_after
+        && host->retry_down_cmd    == entry->retry_down_cmd
+        && host->max_down_interval == entry->max_down_interval
+        && host->confirm_interval  == entry->confirm_interval;
+}
+
+/*
+ * Return the index which `labels` gives the section label of `host`, or
+ * `count` if the label is missing from the new config.
+ */
+size_t
+label_index(dictionary * labels, const struct host_entry * host, size_t count)
+{
+    const char * index = dictionary_get(labels, host->config->label, NULL);
+    return index ? strtoul(index, NULL, 10) : count;
+}
+
+/*
+ * Apply a freshly parsed configuration of `count` hosts to the live one, with
+ * every other shard stopped. `labels` maps each section label to its index.
+ * Entries taken over are cleared from `configs`, leaving the rest for the
+ * caller to free.
+ *
+ * Live hosts missing from the new config are removed. Those whose options
+ * changed are replaced by new entries carrying over their up/down state, and
+ * their statistics too if the hostname stayed the same. New entries are
+ * appended to the least loaded shards. Nothing changes if memory runs out.
  */
 void
-parse_config(const char * conf_file)
+apply_config(struct host_entry * table, struct host_config * configs, size_t count, dictionary * labels)
 {
-    dictionary * conf = iniparser_load(conf_file);
-    if (conf == NULL) {
-        fprintf(stderr, "ERROR: Unable to parse configuration file %s.\n", conf_file);
-        exit(EXIT_FAILURE);
+    struct host_entry ** matches   = calloc(count, sizeof(*matches));
+    bool *               unchanged = calloc(count, sizeof(*unchanged));
+    if (matches == NULL || unchanged == NULL) {
+        fprintf(stderr, "WARN: Unable to allocate memory for reload. Keeping the current configuration.\n");
+        free(matches);
+        free(unchanged);
+        return;
     }
 
-    int host_count = iniparser_getnsec(conf);
-    if (host_count < 1 ) {
-        fprintf(stderr, "ERROR: Unable to determine number of hosts in configuration file.\n");
-        exit(EXIT_FAILURE);
+    /* Pair each live host with the new entry under its label. */
+    for (int i = 0; i < shard_count; i++) {
+        struct shard * s = &shards[i];
+        for (size_t r = 0; r < s->range_count; r++) {
+            struct host_entry * host = s->ranges[r].hosts;
+            for (size_t k = 0; k < s->ranges[r].count; k++, host++) {
+                if (host->removed) continue;
+                size_t j = label_index(labels, host, count);
+                if (j < count && matches[j] == NULL) {
+                    matches[j]   = host;
+                    unchanged[j] = host_unchanged(host, &table[j], &configs[j]);
+                }
+            }
+        }
     }
 
-    struct host_entry * host_list_end = NULL;
-    for (int i=0; i < host_count; i++) {
-        /* Allocate a reusable buffer large enough to hold the full 'section:key' string. */
-        int section_len = strlen(iniparser_getsecname(conf, i));
-        char * key_buf = malloc(section_len + 1 + MAX_CONF_KEY_LEN + 1); /* +1 for ':' and '\0' */
-        strcpy(key_buf, iniparser_getsecname(conf, i));
-        key_buf[section_len++] = ':';
-
-        struct host_entry * cur_host = malloc(sizeof(struct host_entry));
+    size_t added = 0, changed = 0, removed = 0;
+    for (size_t j = 0; j < count; j++) {
+        if (!unchanged[j]) added++;
+        if (matches[j] && !unchanged[j]) changed++;
+    }
 
-        key_buf[section_len] = '\0';
-        strncat(key_buf, "host", MAX_CONF_KEY_LEN);
-        cur_host->name = strdup(iniparser_getstring(conf, key_buf, NULL));
+    /* Added hosts get a segment of their own, which never moves, and one more range in some shards. */
+    struct host_entry *  segment         = calloc(added ? added : 1, sizeof(struct host_entry));
+    struct host_config * segment_configs = calloc(added ? added : 1, sizeof(struct host_config));
+    bool ranges_ok = true;
+    for (int i = 0; i < shard_count && ranges_ok; i++) {
+        struct host_range * grown = realloc(shards[i].ranges, (shards[i].range_count + 1) * sizeof(struct host_range));
+        if (grown) shards[i].ranges = grown;
+        ranges_ok = (grown != NULL);
+    }
+    if (segment == NULL || segment_configs == NULL || !ranges_ok) {
+        fprintf(stderr, "WARN: Unable to allocate memory for reload. Keeping the current configuration.\n");
+        free(segment);
+        free(segment_configs);
+        free(matches);
+        free(unchanged);
+        return;
+    }
 
-        key_buf[section_len] = '\0';
-        strncat(key_buf, "interval", MAX_CONF_KEY_LEN);
-        cur_host->ping_interval = iniparser_getint(conf, key_buf, -1);
+    size_t next = 0;
+    for (size_t j = 0; j < count; j++) {
+        if (unchanged[j]) {
+            /* Parents are linked afresh after every reload, so need not match. */
+            struct host_config * config = matches[j]->config;
+            free(config->parents);
+            config->parents = configs[j].parents;
+            configs[j].parents = NULL;
+            continue;
+        }
+        struct host_entry * host = &segment[next];
+        *host = table[j];
+        segment_configs[next] = configs[j];
+        memset(&configs[j], 0, sizeof(struct host_config));
+        host->config = &segment_configs[next];
+        host->number = next_host_number++;
+        if (matches[j]) {
+            host->host_up = matches[j]->host_up;
+            host->state_unknown = matches[j]->state_unknown;
+            host->sweep_pending = false;
+            if (strcmp(matches[j]->config->name, host->config->name) == 0) host->rtt = matches[j]->rtt;
+        }
+        next++;
+    }
 
-        key_buf[section_len] = '\0';
-        strncat(key_buf, "max_delay", MAX_CONF_KEY_LEN);
-        cur_host->max_delay = iniparser_getint(conf, key_buf, -1);
+    /* Remove the hosts left behind. No transition still queued for the executor may refer to them. */
+    read_transitions(NULL);
+    for (int i = 0; i < shard_count; i++) {
+        shard = &shards[i];
+        for (size_t r = 0; r < shard->range_count; r++) {
+            struct host_entry * host = shard->ranges[r].hosts;
+            for (size_t k = 0; k < shard->ranges[r].count; k++, host++) {
+                if (host->removed) continue;
+                size_t j = label_index(labels, host, count);
+                if (j < count && matches[j] == host && unchanged[j]) continue;
+                if (j >= count || matches[j] != host) removed++;
+                if (verbose) printf("INFO: Removing host %s.\n", host->config->name);
+                remove_host(host);
+                free(host->probe);
+                free(host->pmtu_packet);
+                free(host->parents);
+                host->probe = NULL;
+                host->pmtu_packet = NULL;
+                host->parents = NULL;
+                host->parent_count = 0;
+                free_host_configs(host->config, 1);
+                memset(host->config, 0, sizeof(struct host_config));
+            }
+        }
+    }
 
-        key_buf[section_len] = '\0';
-        strncat(key_buf, "up_cmd", MAX_CONF_KEY_LEN);
-        cur_host->up_cmd = strdup(iniparser_getstring(conf, key_buf, NULL));
+    /* Fill the least loaded shards up to an even share of the hosts. */
+    size_t live = added;
+    for (int i = 0; i < shard_count; i++) live += shards[i].host_count;
+    size_t target = (live + shard_count - 1) / shard_count;
+    next = 0;
+    for (int i = 0; i < shard_count && next < added; i++) {
+        shard = &shards[i];
+        size_t share = (shard->host_count < target) ? target - shard->host_count : 0;
+        if (share > added - next) share = added - next;
+        if (share == 0) continue;
 
-        key_buf[section_len] = '\0';
-        strncat(key_buf, "down_cmd", MAX_CONF_KEY_LEN);
-        cur_host->down_cmd = strdup(iniparser_getstring(conf, key_buf, NULL));
+        struct host_range * range = &shard->ranges[shard->range_count++];
+        range->hosts = &segment[next];
+        range->count = share;
+        next += share;
 
-        key_buf[section_len] = '\0';
-        strncat(key_buf, "start_condition", MAX_CONF_KEY_LEN);
-        const char * value = iniparser_getstring(conf, key_buf, NULL);
-        if (value) cur_host->host_up = *value == 'u' ? true : false;
+        bool need_ipv6 = false;
+        struct host_entry * host = range->hosts;
+        for (size_t k = 0; k < share; k++, host++) {
+            if (prepare_host(host)) need_ipv6 = true;
+            assign_ident(host);
+            shard->host_count++;
+            if (verbose) printf("INFO: Adding host %s.\n", host->config->name);
+        }
+        if (need_ipv6 && shard->icmp6_socket.fd < 0) {
+            open_probe_socket(&shard->icmp6_socket, IPPROTO_ICMPV6);
+            attach_reply_filter(&shard->icmp6_socket, shard->first_ident, shard->ident_span);
+            event_register(shard->icmp6_socket.fd, read_icmp_data, &shard->icmp6_socket);
+        }
+        build_host_hash();
 
-        if (cur_host->name == NULL || cur_host->ping_interval == -1 || cur_host->max_delay == -1) {
-            fprintf(stderr, "ERROR: Problems parsing section %s.\n", iniparser_getsecname(conf, i));
-            exit(EXIT_FAILURE);
+        /* Spread the new hosts' first pings across their intervals, as at startup. */
+        uint64_t now = monotonic_usec();
+        host = range->hosts;
+        for (size_t k = 0; k < share; k++, host++) {
+            host->phase = host->ping_interval * k / share;
+            if (host->resolved) {
+                activate_host(host, now);
+            } else {
+                start_lookup(host);
+            }
         }
+    }
+    shard = &shards[0];
 
-        cur_host->socket = -1;
-        cur_host->next = NULL;
-        gettimeofday(&(cur_host->last_ping_received), (struct timezone *) NULL);
+    printf("INFO: Reloaded configuration: %zu hosts added, %zu changed, %zu removed.\n",
+           added - changed, changed, removed);
+    fflush(stdout);
 
-        if (first_host_in_list == NULL) {
-            first_host_in_list = cur_host;
-            host_list_end = cur_host;
-        } else {
-            host_list_end->next = cur_host;
-            host_list_end = cur_host;
-        }
+    free(matches);
+    free(unchanged);
+}
 
-        free(key_buf);
+/*
+ * Parse the config files again and apply any differences to the hosts being
+ * monitored, matching hosts by section label. Triggered by SIGHUP. Runs on
+ * the main thread, stopping the other shards while hosts change.
+ *
+ * A config with any problems is rejected as a whole.
+ */
+void
+reload_config(void)
+{
+    struct host_entry *  table   = NULL;
+    struct host_config * configs = NULL;
+    size_t               count   = 0;
+    bool ok = true;
+    for (int i = 0; ok && i < config_file_count; i++) {
+        ok = parse_config(config_files[i], &table, &configs, &count);
     }
-    iniparser_freedict(conf);
+
+    /* With a label repeated across files, the first entry is matched and the others added. */
+    dictionary * labels = ok ? index_labels(configs, count) : NULL;
+    if (labels && !check_parents(configs, count, labels)) {
+        dictionary_del(labels);
+        labels = NULL;
+    }
+
+    if (labels) {
+        stop_shards();
+        apply_config(table, configs, count, labels);
+        link_parents();
+        if (state_file) map_state_file();
+        resume_shards();
+        dictionary_del(labels);
+    } else {
+        fprintf(stderr, "WARN: Unable to reload configuration. Keeping the current configuration.\n");
+    }
+
+    free_host_configs(configs, count);
+    free(configs);
+    free(table);
 }
 
 /*
- * Parse string (IP or hostname) to Internet address.
- *
- * Returns 0 if host can't be resolved, otherwise returns an Internet address.
+ * This function contains each shard's program loop, firing due timers and
+ * sleeping in the event backend until the next timer or an incoming reply.
  */
-uint32_t
-get_host_addr(const char * name)
+void
+get_response(void)
 {
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
+    assert(shard->icmp4_socket.fd >= 0);
 
-    int rv;
-    struct addrinfo * address;
-    if ((rv = getaddrinfo(name, NULL, &hints, &address)) != 0) return 0;
-    uint32_t result = ((struct sockaddr_in *)(address->ai_addr))->sin_addr.s_addr;
-    freeaddrinfo(address);
-    return result;
+    event_register(shard->icmp4_socket.fd, read_icmp_data, &shard->icmp4_socket);
+    if (shard->icmp6_socket.fd >= 0) event_register(shard->icmp6_socket.fd, read_icmp_data, &shard->icmp6_socket);
+
+    while (true) {
+        timer_run_expired(monotonic_usec());
+        send_batch_flush();
+        event_dispatch(timer_timeout_ms(monotonic_usec()));
+        /* Signals are only delivered to the main thread. */
+        if (stats_requested && shard == &shards[0]) {
+            stats_requested = 0;
+            request_shard_stats();
+        }
+        if (reload_requested && shard == &shards[0]) {
+            reload_requested = 0;
+            reload_config();
+        }
+        if (exit_requested && shard == &shards[0]) exit_saving_state();
+    }
+}
+
+/*
+ * Body of each shard's worker thread, other than the first shard's which
+ * runs on the main thread.
+ */
+void *
+shard_thread(void * context)
+{
+    shard = context;
+    get_response();
+    return NULL;
 }
 
+/*
+ * Partition the host list into `shard_count` contiguous shards of near equal
+ * size, leaving the calling thread in the first.
+ */
 void
-remove_host_from_list(struct host_entry * host)
+init_shards(void)
 {
-    assert(first_host_in_list);
-    assert(host);
+    if ((size_t) shard_count > total_hosts) shard_count = total_hosts;
 
-    if (host == first_host_in_list) {
-        first_host_in_list = host->next;
-    } else {
-        struct host_entry * temp = first_host_in_list;
-        while (temp->next != host && temp->next != NULL) temp = temp->next;
-        if (temp->next == NULL) return;
-        temp->next = temp->next->next;
+    /* Shards are cache line aligned, keeping each one's metrics apart. */
+    if ((shards = aligned_alloc(CACHE_LINE_BYTES, shard_count * sizeof(struct shard))) == NULL) {
+        fprintf(stderr, "ERROR: Unable to allocate shards.\n");
+        exit(EXIT_FAILURE);
     }
-    free(host);
+    memset(shards, 0, shard_count * sizeof(struct shard));
+
+    /* Identifier ranges are equal in size, leaving room for hosts added by reloads. */
+    size_t ident_span = 2 * (total_hosts / shard_count + 1);
+    if (ident_span < MIN_IDENT_SPAN) ident_span = MIN_IDENT_SPAN;
+    if (ident_span > 0x10000 / shard_count) ident_span = 0x10000 / shard_count;
+
+    size_t index = 0;
+    for (int i = 0; i < shard_count; i++) {
+        struct shard * s = &shards[i];
+        if ((s->ranges = malloc(sizeof(struct host_range))) == NULL) {
+            fprintf(stderr, "ERROR: Unable to allocate shards.\n");
+            exit(EXIT_FAILURE);
+        }
+        s->range_count     = 1;
+        s->ranges[0].hosts = &host_table[index];
+        s->ranges[0].count = total_hosts / shard_count + ((size_t) i < total_hosts % shard_count);
+        s->host_count      = s->ranges[0].count;
+        s->first_index     = index;
+        index += s->host_count;
+        s->ident_span  = ident_span;
+        s->first_ident = (getpid() + i * ident_span) & 0xFFFF;
+
+        s->icmp4_socket.fd     = -1;
+        s->icmp4_socket.family = AF_INET;
+        s->icmp6_socket.fd     = -1;
+        s->icmp6_socket.family = AF_INET6;
+#if defined(EVENT_BACKEND_EPOLL) || defined(EVENT_BACKEND_KQUEUE)
+        s->event_fd = -1;
+#endif
+        s->wake_pipe[0] = s->wake_pipe[1] = -1;
+        s->lookup_limit = (max_lookups / shard_count > 0) ? max_lookups / shard_count : 1;
+        atomic_init(&s->stats_pending, false);
+        atomic_init(&s->park_pending, false);
+    }
+
+    /* Each shard enforces an equal share of the global rate limit. */
+    rate_limit_gap *= shard_count;
+
+    shard = &shards[0];
+}
+
+/*
+ * Start a worker thread for every shard but the first, pinned to its own CPU
+ * where supported. The main thread, whose affinity up/down commands inherit,
+ * is left unpinned. Signals are blocked in workers so they reach the main
+ * thread.
+ */
+void
+start_shards(void)
+{
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+    for (int i = 1; i < shard_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, shard_thread, &shards[i]) != 0) {
+            fprintf(stderr, "ERROR: Unable to start shard thread.\n");
+            exit(EXIT_FAILURE);
+        }
+#if defined(__linux__)
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus > 1) {
+            cpu_set_t cpu;
+            CPU_ZERO(&cpu);
+            CPU_SET(i % cpus, &cpu);
+            pthread_setaffinity_np(thread, sizeof(cpu), &cpu);
+        }
+#endif
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
 }
 
 void
@@ -370,49 +4511,81 @@ init_hosts(void)
         exit(EXIT_FAILURE);
     }
 
-    assert(first_host_in_list);
-    host = first_host_in_list;
-    while (host) {
-        struct host_entry * next_host = host->next;
-        bzero(&host->dest, sizeof(host->dest));
-        host->dest.sin_family = AF_INET;
-        if (!(host->dest.sin_addr.s_addr = get_host_addr(host->name))) {
-            fprintf(stderr, "WARN: Removing unresolvable host %s from list.\n", host->name);
-            remove_host_from_list(host);
-        }
-        host = next_host;
+    /* IP addresses are used as-is. Hostnames are resolved in the background. */
+    assert(total_hosts > 0);
+    bool need_ipv6 = false;
+    for (host = host_table; host < host_table + total_hosts; host++) {
+        /* The table no longer moves, so configs may now be pointed to. */
+        host->config = &host_configs[host - host_table];
+        host->number = next_host_number++;
+        if (prepare_host(host)) need_ipv6 = true;
     }
 
-    assert(first_host_in_list);
-    host = first_host_in_list;
-    while (host) {
-        struct host_entry * next_host = host->next;
-        if ((host->socket = socket(AF_INET, SOCK_RAW, proto->p_proto)) < 0) {
-            fprintf(stderr, "WARN: Failed creating socket. Removing host %s from list.\n", host->name);
-            remove_host_from_list(host);
+    /* Each shard gets its own event backend and sockets. */
+    for (int i = 0; i < shard_count; i++) {
+        shard = &shards[i];
+        event_init();
+        open_probe_socket(&shard->icmp4_socket, proto->p_proto);
+        /* The ICMPv6 socket is only opened when some host may need it. */
+        if (need_ipv6) open_probe_socket(&shard->icmp6_socket, IPPROTO_ICMPV6);
+        host = shard->ranges[0].hosts;
+        for (size_t j = 0; j < shard->ranges[0].count; j++, host++) assign_ident(host);
+        build_host_hash();
+        attach_reply_filter(&shard->icmp4_socket, shard->first_ident, shard->ident_span);
+        attach_reply_filter(&shard->icmp6_socket, shard->first_ident, shard->ident_span);
+        init_batch_io();
+        init_wakeups();
+
+        host = shard->ranges[0].hosts;
+        for (size_t j = 0; j < shard->ranges[0].count; j++, host++) {
+            if (!host->resolved) start_lookup(host);
         }
-        host = next_host;
+
+        /* Pings are sent and deadlines checked by timers fired from the shard's loop. */
+        schedule_hosts();
     }
+    shard = &shards[0];
+
+    /* Children judge their parents' state, read across shards. */
+    link_parents();
+
+    init_resolver();
 }
 
 void
 print_usage(char ** argv)
 {
     printf( "ICMPmonitor v%d (www.subgeniuskitty.com)\n"
-            "Usage: %s [-h] [-v] [-r] -f <file>\n"
+            "Usage: %s [-h] [-v] [-r] [-t] [-u] [-s <threads>] [-l <rate>] [-j <max>] [-c <time> -b <cmd>] -f <file>\n"
             "  -v         Verbose mode. Prints message for each packet sent and received.\n"
-            "  -r         Repeat down_cmd every time a host fails to respond to a packet.\n"
+            "  -r         Repeat down_cmd every time a host fails to respond to a packet, unless\n"
+            "             overridden by retry_down_cmd in the config file.\n"
             "             Note: Default behavior executes down_cmd only once, resetting once the host is back up.\n"
+            "  -t         Measure RTT with kernel (or NIC hardware) packet timestamps.\n"
+            "  -u         Use unprivileged datagram ICMP sockets rather than raw sockets.\n"
+            "  -s <count> Spread hosts across <count> monitoring threads (default 1).\n"
+            "  -l <rate>  Limit outgoing pings to <rate> packets per second across all hosts.\n"
+            "  -j <max>   Run at most <max> up/down commands at once, queueing the rest (default %d).\n"
+            "  -c <time>  Coalesce host transitions occurring within <time> (e.g. 500ms) into one execution\n"
+            "             of the -b command, listing hosts in $ICMPMONITOR_UP and $ICMPMONITOR_DOWN.\n"
+            "  -b <cmd>   Batch command executed for transitions coalesced by -c.\n"
+            "  -n <max>   Resolve at most <max> hostnames in parallel (default %d).\n"
+            "  -w <time>  Give up on a hostname lookup after <time> and retry later (default %ds).\n"
+            "  -p <file>  Save host states to <file>, restoring hosts with start_condition = auto on restart.\n"
+            "  -m <dest>  Push StatsD metrics to <dest>, given as host:port, every %ds.\n"
+            "  -e <file>  Log every probe outcome as binary records to <file>, or unix:<path> for a socket.\n"
             "  -h         Help (prints this message)\n"
             "  -f <file>  Specify a configuration file.\n"
-            , VERSION, argv[0]);
+            , VERSION, argv[0], DEFAULT_MAX_CHILDREN, DEFAULT_MAX_LOOKUPS, DEFAULT_LOOKUP_TIMEOUT / USEC_PER_SEC,
+            METRICS_INTERVAL / USEC_PER_SEC);
 }
 
 void
 parse_params(int argc, char ** argv)
 {
     int param;
-    while ((param = getopt(argc, argv, "hrvf:")) != -1) {
+    double rate;
+    while ((param = getopt(argc, argv, "hrtuvs:f:l:j:c:b:n:w:p:m:e:")) != -1) {
         switch(param) {
             case 'v':
                 verbose = true;
@@ -420,8 +4593,69 @@ parse_params(int argc, char ** argv)
             case 'r':
                 retry_down_cmd = true;
                 break;
+            case 't':
+                kernel_timestamps = true;
+                break;
+            case 'u':
+                unprivileged = true;
+                break;
+            case 's':
+                if ((shard_count = atoi(optarg)) < 1) {
+                    fprintf(stderr, "ERROR: Thread count must be at least 1.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'f':
-                parse_config(optarg);
+                config_files = realloc(config_files, (config_file_count + 1) * sizeof(char *));
+                if (config_files == NULL) {
+                    fprintf(stderr, "ERROR: Unable to allocate memory.\n");
+                    exit(EXIT_FAILURE);
+                }
+                config_files[config_file_count++] = optarg;
+                break;
+            case 'l':
+                rate = atof(optarg);
+                if (rate <= 0 || rate > USEC_PER_SEC) {
+                    fprintf(stderr, "ERROR: Rate limit must be between 0 and %d packets per second.\n", USEC_PER_SEC);
+                    exit(EXIT_FAILURE);
+                }
+                rate_limit_gap = USEC_PER_SEC / rate;
+                break;
+            case 'c':
+                if ((coalesce_window = parse_duration(optarg)) == 0) {
+                    fprintf(stderr, "ERROR: Invalid coalescing window %s.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                batch_command = optarg;
+                break;
+            case 'p':
+                state_file = optarg;
+                break;
+            case 'm':
+                metrics_destination = optarg;
+                break;
+            case 'e':
+                event_log_path = optarg;
+                break;
+            case 'n':
+                if ((max_lookups = atoi(optarg)) < 1) {
+                    fprintf(stderr, "ERROR: Lookup limit must be at least 1.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                if ((lookup_timeout = parse_duration(optarg)) == 0) {
+                    fprintf(stderr, "ERROR: Invalid lookup timeout %s.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'j':
+                if ((max_children = atoi(optarg)) < 1) {
+                    fprintf(stderr, "ERROR: Command limit must be at least 1.\n");
+                    exit(EXIT_FAILURE);
+                }
                 break;
             case 'h':
             default:
@@ -430,28 +4664,79 @@ parse_params(int argc, char ** argv)
                 break;
         }
     }
-    if (first_host_in_list == NULL) {
+    if ((coalesce_window == 0) != (batch_command == NULL)) {
+        fprintf(stderr, "ERROR: The -c and -b flags must be used together.\n");
+        print_usage(argv);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Config files are parsed once every flag is known, as some set defaults for hosts. */
+    for (int i = 0; i < config_file_count; i++) {
+        if (!parse_config(config_files[i], &host_table, &host_configs, &total_hosts)) exit(EXIT_FAILURE);
+    }
+    if (total_hosts == 0) {
         fprintf(stderr, "ERROR: Unable to parse a config file.\n");
         print_usage(argv);
         exit(EXIT_FAILURE);
     }
+
+    /* Parents may be named across config files, so are checked once all are parsed. */
+    dictionary * labels = index_labels(host_configs, total_hosts);
+    if (labels == NULL) {
+        fprintf(stderr, "ERROR: Unable to allocate memory indexing hosts.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!check_parents(host_configs, total_hosts, labels)) exit(EXIT_FAILURE);
+    dictionary_del(labels);
 }
 
+/* The fuzz target and microbenchmarks include this file with NO_MAIN defined, to call its functions directly. */
+#if !defined(NO_MAIN)
 int
 main(int argc, char ** argv)
 {
     /* Parse the command line options, load and parse the config file. */
     parse_params(argc, argv);
 
+    /* Pick a checksum implementation before any probe is built. */
+    init_checksum();
+
+    /* Hosts starting in `auto` take the state saved by the previous run. */
+    if (state_file) restore_state();
+
+    /* Divide the hosts among shards, each with its own event backend and scheduler. */
+    init_shards();
+
     /* Process config for each host, generating/verifying any necessary information. */
     init_hosts();
 
     /* Make sure initialization left us with something useful. */
-    assert(first_host_in_list);
+    assert(total_hosts > 0);
+
+    /* Print RTT statistics on demand. */
+    signal(SIGUSR1, request_stats);
+
+    /* Reload the config files on demand. */
+    signal(SIGHUP, request_reload);
+
+    /* Save host states periodically and on exit. */
+    if (state_file) {
+        init_state();
+        signal(SIGTERM, request_exit);
+        signal(SIGINT, request_exit);
+    }
+
+    /* Up/down commands run from the main thread, registering with the first shard's event backend. */
+    init_executor();
+
+    /* Metrics are pushed from the main thread too. */
+    if (metrics_destination) init_metrics(metrics_destination);
+
+    /* Probe outcomes are logged by a thread of their own. */
+    if (event_log_path) init_event_log();
 
-    /* Pings are sent asynchronously. */
-    signal(SIGALRM, pinger);
-    alarm(TIMER_RESOLUTION);
+    /* Other shards run on their own threads. */
+    start_shards();
 
     /* The main program loop listens for ping responses. */
     get_response();
@@ -459,3 +4744,4 @@ main(int argc, char ** argv)
     /* Should be unreachable. */
     exit(EXIT_SUCCESS);
 }
+#endif
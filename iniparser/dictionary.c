@@ -29,6 +29,10 @@
 /** Invalid key token */
 #define DICT_INVALID_KEY    ((char*)-1)
 
+/** Markers for index buckets not holding an entry position */
+#define DICT_INDEX_EMPTY    ((ssize_t)-1)
+#define DICT_INDEX_DELETED  ((ssize_t)-2)
+
 /*---------------------------------------------------------------------------
                             Private functions
  ---------------------------------------------------------------------------*/
@@ -58,6 +62,70 @@ static char * xstrdup(const char * s)
     return t ;
 }
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Rebuild the hash index of a dictionary
+  @param    d Dictionary to reindex
+  @param    index_size Number of buckets, a power of two above d->size
+  @return   This function returns non-zero in case of failure
+
+  Deletion marks are dropped along the way. On failure the previous index
+  is left in place.
+ */
+/*--------------------------------------------------------------------------*/
+static int dictionary_reindex(dictionary * d, size_t index_size)
+{
+    ssize_t * new_index ;
+    size_t    mask = index_size - 1 ;
+    size_t    b ;
+    ssize_t   i ;
+
+    new_index = (ssize_t*) malloc(index_size * sizeof *new_index);
+    if (!new_index)
+        return -1 ;
+    for (b=0 ; b<index_size ; b++)
+        new_index[b] = DICT_INDEX_EMPTY ;
+    for (i=0 ; i<d->size ; i++) {
+        if (d->key[i]==NULL)
+            continue ;
+        for (b = d->hash[i] & mask ; new_index[b]!=DICT_INDEX_EMPTY ; b = (b+1) & mask)
+            ;
+        new_index[b] = i ;
+    }
+    free(d->index);
+    d->index = new_index ;
+    d->index_size = index_size ;
+    d->index_used = d->n ;
+    return 0 ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Find the index bucket of a key
+  @param    d Dictionary to search
+  @param    key Key to look for
+  @param    hash Hash value of key
+  @return   Bucket holding the position of key, or -1 if not found
+
+  The index always keeps an empty bucket, which ends the probe sequence.
+ */
+/*--------------------------------------------------------------------------*/
+static ssize_t dictionary_find(const dictionary * d, const char * key, unsigned hash)
+{
+    size_t   mask = d->index_size - 1 ;
+    size_t   b ;
+    ssize_t  i ;
+
+    for (b = hash & mask ; (i = d->index[b])!=DICT_INDEX_EMPTY ; b = (b+1) & mask) {
+        if (i==DICT_INDEX_DELETED)
+            continue ;
+        /* Compare hash, then string to avoid hash collisions */
+        if (hash==d->hash[i] && !strcmp(key, d->key[i]))
+            return (ssize_t)b ;
+    }
+    return -1 ;
+}
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Double the size of the dictionary
@@ -97,7 +165,8 @@ static int dictionary_grow(dictionary * d)
     d->val = new_val;
     d->key = new_key;
     d->hash = new_hash;
-    return 0 ;
+    /* Keep the index at most half full of entries */
+    return dictionary_reindex(d, d->index_size * 2) ;
 }
 
 /*---------------------------------------------------------------------------
@@ -157,10 +226,21 @@ dictionary * dictionary_new(size_t size)
     d = (dictionary*) calloc(1, sizeof *d) ;
 
     if (d) {
+        size_t index_size = 1 ;
+        while (index_size < size * 2)
+            index_size <<= 1 ;
+
         d->size = size ;
         d->val  = (char**) calloc(size, sizeof *d->val);
         d->key  = (char**) calloc(size, sizeof *d->key);
         d->hash = (unsigned*) calloc(size, sizeof *d->hash);
+        if (!d->val || !d->key || !d->hash || dictionary_reindex(d, index_size)!=0) {
+            free(d->val);
+            free(d->key);
+            free(d->hash);
+            free(d);
+            return NULL ;
+        }
     }
     return d ;
 }
@@ -188,6 +268,7 @@ void dictionary_del(dictionary * d)
     free(d->val);
     free(d->key);
     free(d->hash);
+    free(d->index);
     free(d);
     return ;
 }
@@ -208,22 +289,12 @@ void dictionary_del(dictionary * d)
 /*--------------------------------------------------------------------------*/
 const char * dictionary_get(const dictionary * d, const char * key, const char * def)
 {
-    unsigned    hash ;
-    ssize_t      i ;
+    ssize_t      b ;
 
-    hash = dictionary_hash(key);
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
-            continue ;
-        /* Compare hash */
-        if (hash==d->hash[i]) {
-            /* Compare string, to avoid hash collisions */
-            if (!strcmp(key, d->key[i])) {
-                return d->val[i] ;
-            }
-        }
-    }
-    return def ;
+    b = dictionary_find(d, key, dictionary_hash(key));
+    if (b<0)
+        return def ;
+    return d->val[d->index[b]] ;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -255,6 +326,8 @@ const char * dictionary_get(const dictionary * d, const char * key, const char *
 int dictionary_set(dictionary * d, const char * key, const char * val)
 {
     ssize_t         i ;
+    ssize_t         b ;
+    size_t          mask ;
     unsigned       hash ;
 
     if (d==NULL || key==NULL) return -1 ;
@@ -262,21 +335,15 @@ int dictionary_set(dictionary * d, const char * key, const char * val)
     /* Compute hash for this key */
     hash = dictionary_hash(key) ;
     /* Find if value is already in dictionary */
-    if (d->n>0) {
-        for (i=0 ; i<d->size ; i++) {
-            if (d->key[i]==NULL)
-                continue ;
-            if (hash==d->hash[i]) { /* Same hash value */
-                if (!strcmp(key, d->key[i])) {   /* Same key */
-                    /* Found a value: modify and return */
-                    if (d->val[i]!=NULL)
-                        free(d->val[i]);
-                    d->val[i] = (val ? xstrdup(val) : NULL);
-                    /* Value has been modified: return */
-                    return 0 ;
-                }
-            }
-        }
+    b = dictionary_find(d, key, hash);
+    if (b>=0) {
+        /* Found a value: modify and return */
+        i = d->index[b] ;
+        if (d->val[i]!=NULL)
+            free(d->val[i]);
+        d->val[i] = (val ? xstrdup(val) : NULL);
+        /* Value has been modified: return */
+        return 0 ;
     }
     /* Add a new value */
     /* See if dictionary needs to grow */
@@ -297,6 +364,17 @@ int dictionary_set(dictionary * d, const char * key, const char * val)
     d->val[i]  = (val ? xstrdup(val) : NULL) ;
     d->hash[i] = hash;
     d->n ++ ;
+
+    /* Index the new entry in the first free bucket, reusing deletion marks */
+    mask = d->index_size - 1 ;
+    for (b = hash & mask ; d->index[b]>=0 ; b = (b+1) & mask)
+        ;
+    if (d->index[b]==DICT_INDEX_EMPTY)
+        d->index_used ++ ;
+    d->index[b] = i ;
+    /* Sweep away deletion marks before they fill the index */
+    if (d->index_used * 4 > d->index_size * 3)
+        return dictionary_reindex(d, d->index_size) ;
     return 0 ;
 }
 
@@ -313,29 +391,19 @@ int dictionary_set(dictionary * d, const char * key, const char * val)
 /*--------------------------------------------------------------------------*/
 void dictionary_unset(dictionary * d, const char * key)
 {
-    unsigned    hash ;
+    ssize_t      b ;
     ssize_t      i ;
 
     if (key == NULL || d == NULL) {
         return;
     }
 
-    hash = dictionary_hash(key);
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
-            continue ;
-        /* Compare hash */
-        if (hash==d->hash[i]) {
-            /* Compare string, to avoid hash collisions */
-            if (!strcmp(key, d->key[i])) {
-                /* Found key */
-                break ;
-            }
-        }
-    }
-    if (i>=d->size)
+    b = dictionary_find(d, key, dictionary_hash(key));
+    if (b<0)
         /* Key not found */
         return ;
+    i = d->index[b] ;
+    d->index[b] = DICT_INDEX_DELETED ;
 
     free(d->key[i]);
     d->key[i] = NULL ;
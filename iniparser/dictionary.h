@@ -37,9 +37,9 @@ extern "C" {
   @brief    Dictionary object
 
   This object contains a list of string/string associations. Each
-  association is identified by a unique string key. Looking up values
-  in the dictionary is speeded up by the use of a (hopefully collision-free)
-  hash function.
+  association is identified by a unique string key. Entries are kept in
+  insertion order, and located through an open-addressing hash index so
+  that looking up or setting a key takes constant time on average.
  */
 /*-------------------------------------------------------------------------*/
 typedef struct _dictionary_ {
@@ -48,6 +48,9 @@ typedef struct _dictionary_ {
     char        **  val ;   /** List of string values */
     char        **  key ;   /** List of string keys */
     unsigned     *  hash ;  /** List of hash values for keys */
+    ssize_t      *  index ; /** Hash index of entry positions, linearly probed */
+    size_t          index_size ; /** Number of index buckets, a power of two */
+    size_t          index_used ; /** Buckets holding an entry or a deletion mark */
 } dictionary ;
 
 
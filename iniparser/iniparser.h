@@ -83,6 +83,27 @@ int iniparser_getnsec(const dictionary * d);
 const char * iniparser_getsecname(const dictionary * d, int n);
 
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Iterate over the sections of a dictionary.
+  @param    d   Dictionary to examine
+  @param    pos Iteration state, set to 0 before the first call.
+  @return   Pointer to char string
+
+  This function returns the name of the section following the one last
+  returned for pos, in the order the sections appear in the ini file, and
+  advances pos past it. Iterating over all sections this way takes time
+  linear in the size of the dictionary, unlike repeated calls to
+  iniparser_getsecname(). Do not free or modify the returned string!
+
+  This function returns NULL once every section has been returned, or in
+  case of error.
+ */
+/*--------------------------------------------------------------------------*/
+
+const char * iniparser_nextsec(const dictionary * d, int * pos);
+
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Save a dictionary to a loadable ini file